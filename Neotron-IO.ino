@@ -1,8 +1,10 @@
 /**
  * Neotron-IO Firmware.
  *
- * Uses MiniCore for the AtMega328P. Set to 8 MHz Internal RC. Don't go higher
- * than 9600 baud.
+ * Uses MiniCore for the AtMega328P. Set to 8 MHz Internal RC. We boot at 9600
+ * baud; the host can ask for more once OSCCAL has been calibrated.
+ *
+ * The host UART is driven directly (see `uart.h`), so don't use `Serial`.
  *
  * This project is also licensed under the GPL (v3 or later version, at your
  * choice). See the [LICENCE](./LICENCE) file.
@@ -14,89 +16,236 @@
 // Includes
 //
 #include <EEPROM.h>
+#include <avr/sleep.h>
 
 #include "RingBuf.h"
+#include "capture.h"
+#include "command.h"
+#include "config.h"
+#include "hex.h"
 #include "joystick.h"
+#include "keyboard.h"
+#include "mouse.h"
+#include "osccal.h"
+#include "output.h"
 #include "ps2.h"
+#include "ps2bus.h"
+#include "report.h"
+#include "board.h"
+#include "scheduler.h"
+#include "ticks.h"
+#include "uart.h"
 
 //
 // Constants
 //
 
-// Pins D0 and D1 are for the UART
-const int JS1_PIN_START_C = 2;
-const int JS1_PIN_GND_RIGHT = 3;
-const int JS1_PIN_GND_LEFT = 4;
-const int JS1_PIN_DOWN = 5;
-const int JS1_PIN_AB = 6;
-const int JS1_PIN_UP = 7;
-
 #ifdef REAL_ARDUINO_UNO
-const int JS2_PIN_AB = 8;
-const int JS2_PIN_UP = 9;
+using Board = BoardArduinoUno;
 #elif NEOTRON_32
-const int JS2_PIN_AB = 20;
-const int JS2_PIN_UP = 21;
+using Board = BoardNeotron32;
 #else
 #error Please select a supported board
 #endif
-const int JS2_PIN_START_C = 10;
-const int JS2_PIN_GND_RIGHT = 11;
-const int JS2_PIN_GND_LEFT = 12;
-const int JS2_PIN_DOWN = 13;
-
-const int KB_CLK = A0;
-const int KB_DAT = A1;
-const int MS_CLK = A2;
-const int MS_DAT = A3;
-const int JS2_PIN_SELECT = A4;
-const int JS1_PIN_SELECT = A5;
+
+// Clock in PS/2 words from the pin-change interrupt, rather than relying on
+// `loop()` spinning fast enough to see every clock edge.
+const bool PS2_INTERRUPT_DRIVEN = true;
+
+using Devices = BoardDevices<Board, PS2_INTERRUPT_DRIVEN>;
+
+// One of the few 'standard' baud rates you can easily hit from an 8 MHz
+// clock. We always boot at this rate.
+const uint32_t HOST_BAUD_RATE = 9600;
+
+// Rates the host can pick with the `R` command, once OSCCAL is calibrated.
+// 57600 is 2.1% out from an 8 MHz clock, so needs a well-trimmed OSCCAL.
+static const uint32_t HOST_BAUD_RATES[] = { 9600, 19200, 38400, 57600 };
 
 const uint8_t EEPROM_MAGIC_BYTE = 0xE0;
 const int EEPROM_ADDR_MAGIC = 0;
 const int EEPROM_ADDR_OSCCAL = 1;
+// Where the `Config` block starts (see `config.h`)
+const int EEPROM_ADDR_CONFIG = 16;
+
+// How long A has to be held in calibration mode, to step OSCCAL
+const uint16_t CAL_DEBOUNCE_TICKS = ticksFromMicros<20000>();
+
+// How often calibration mode prints the current OSCCAL, in milliseconds.
+// Too long for the 16-bit tick count at 16 MHz, so `millis()` times it.
+const unsigned long CAL_REPORT_MS = 50;
+
+// Joysticks are sampled on a Timer2 tick at this rate
+const uint32_t JOYSTICK_SCAN_HZ = 1000;
+
+// A joystick button has to read the same for this many samples in a row
+// before we report it (so 4 ms at 1 kHz).
+const uint8_t JOYSTICK_DEBOUNCE_SAMPLES = 4;
+
+// The most bytes one reply can carry (the `Q` statistics)
+const size_t MAX_REPLY_BYTES = 20;
+
+// Room a 4-byte mouse packet needs in the mouse output lane, as an ASCII line
+const size_t MOUSE_PACKET_SPACE = 10;
 
-const int CALIBRATION_OUT = MS_DAT;
+// Room an `a01yy` line needs in the mouse output lane
+const size_t MOUSE_WRITE_DONE_SPACE = 6;
 
-const uint16_t DEBOUNCE_LOOPS = 5;
+// Mouse lane space that movement packets leave alone, so an ACK (`mFA`) and
+// the write-done after it always fit. Each message also takes a length byte.
+const size_t MOUSE_RESERVED_SPACE = ( 4 + 1 ) + ( MOUSE_WRITE_DONE_SPACE + 1 );
 
-const size_t MAX_INPUT_BUFFER = 16;
+// Don't sleep until the joysticks have been left alone for this many
+// samples (so one second at 1 kHz)
+const uint16_t JOYSTICK_IDLE_SAMPLES = 1000;
+
+// Halve the loop timing totals once they get this big, so they never wrap
+const uint32_t LOOP_TOTAL_LIMIT = 0x80000000UL;
+
+// How many runs a line capture can hold, and how many go in each `w` line
+const uint8_t CAPTURE_RUNS = 128;
+const uint8_t CAPTURE_RUNS_PER_LINE = 8;
+
+// Room a full `w` line needs in the urgent output lane
+const size_t CAPTURE_LINE_SPACE = 1 + ( 4 * CAPTURE_RUNS_PER_LINE ) + 1;
+
+// `L` arguments - which port to capture, or stop
+const uint8_t CAPTURE_KEYBOARD = 0x00;
+const uint8_t CAPTURE_MOUSE = 0x01;
+const uint8_t CAPTURE_STOP = 0xFF;
+
+// `E` arguments that save the settings to EEPROM, or put back the defaults
+const uint8_t CONFIG_SAVE = 0xFF;
+const uint8_t CONFIG_DEFAULTS = 0xFE;
+
+// Give the devices this long after power-on to finish their self-test,
+// before we send them the stored init sequences
+const unsigned long PS2_INIT_DELAY_MS = 750;
+
+// Which port an `a` (write done) indication is about
+const uint8_t WRITE_DONE_KEYBOARD = 0x00;
+const uint8_t WRITE_DONE_MOUSE = 0x01;
 
 //
 // Variables
 //
 
-static Joystick<JS1_PIN_UP,
-                JS1_PIN_DOWN,
-                JS1_PIN_GND_LEFT,
-                JS1_PIN_GND_RIGHT,
-                JS1_PIN_AB,
-                JS1_PIN_START_C,
-                JS1_PIN_SELECT>
-    gJs1;
-static Joystick<JS2_PIN_UP,
-                JS2_PIN_DOWN,
-                JS2_PIN_GND_LEFT,
-                JS2_PIN_GND_RIGHT,
-                JS2_PIN_AB,
-                JS2_PIN_START_C,
-                JS2_PIN_SELECT>
-    gJs2;
-static Ps2<KB_CLK, KB_DAT> gKeyboard;
-static Ps2<MS_CLK, MS_DAT> gMouse;
-static RingBuf<char, 256> gSerialBuffer;
+static Devices::Joystick1 gJs1;
+static Devices::Joystick2 gJs2;
+static Devices::Keyboard gKeyboard;
+static Devices::Mouse gMouse;
+static Devices::Bus gPs2Bus( gKeyboard, gMouse );
+static MouseAssembler gMouseAssembler;
+static KeyboardDecoder gKeyboardDecoder;
+static bool gKeyboardDecode = false;
+// Only ever holds whole messages, moved in by `gOutput`
+static SpscRingBuf<char, 64> gSerialBuffer;
+// Filled in by the RX interrupt, emptied by `taskHostInput`
+static SpscRingBuf<HostCommand, 4> gCommandQueue;
+static CommandParser<SpscRingBuf<HostCommand, 4>> gCommandParser(
+    gCommandQueue, HOST_COMMANDS );
+static HostUart<SpscRingBuf<char, 64>,
+                CommandParser<SpscRingBuf<HostCommand, 4>>>
+    gUart( gSerialBuffer, gCommandParser );
 static bool gCalibrationMode = 0;
+static OscCalibrator gOscCal;
+static bool gOscCalValid = false;
+static uint32_t gPendingBaud = HOST_BAUD_RATE;
+static bool gBaudChangePending = false;
+static volatile bool gJoystickTick = false;
+// Joystick 1's last reading, for calibration mode
+static JoystickResult gJs1Bits;
+// How long passes of `loop()` take, in ticks, since the statistics were
+// last cleared
+static uint16_t gLoopMaxTicks = 0;
+static uint32_t gLoopTotalTicks = 0;
+static uint32_t gLoopPasses = 0;
+// Joystick samples since either joystick last changed
+static uint16_t gJoystickQuietSamples = 0;
+// The settings we booted with, and any changes from `E` commands
+static Config gConfig;
+static bool gInitSequencesSent = false;
+// The `L` command's line capture, and which port it's watching
+static LineCapture<CAPTURE_RUNS> gCapture;
+static uint8_t gCapturePort = 0;
+
+static HostProtocol gHostProtocol = HostProtocol::Ascii;
 
 //
 // Private Function Declarations
 //
 
-static void bufferPrint( const String& s );
-static void bufferPrintln();
-static void bufferPrintln( const String& s );
-static void bufferPrintHex( uint16_t value );
-static void bufferPrintHex2( uint8_t value );
-static char wordToHex( uint16_t value, uint8_t nibble_idx );
+static void bufferPrint( const __FlashStringHelper* s );
+static void bufferPrintReply( char command, uint8_t value );
+static void bufferPrintReply( char command,
+                              const uint8_t* data,
+                              uint8_t data_len );
+static void reportByte( Report source, uint8_t value );
+static void reportBytes( Report source, const uint8_t* data, uint8_t data_len );
+static void reportBytes( OutputLane lane,
+                         Report source,
+                         const uint8_t* data,
+                         uint8_t data_len );
+static uint8_t formatJoystick( uint8_t joystick, uint16_t state, char* out );
+static void executeCommand( char command,
+                            const uint8_t* data,
+                            uint8_t data_len );
+static void saveOscCal();
+static void loadConfig();
+static void saveConfig();
+static void setDefaultConfig( Config& config );
+static bool isConfigUsable( const Config& config );
+static void configCommand( const uint8_t* data, uint8_t data_len );
+static void reportKey( Report source, uint8_t key );
+static void reportWriteDone( uint8_t device, Ps2WriteResult result );
+static uint8_t* putWord( uint8_t* out, uint16_t value );
+static void reportStatistics();
+static void clearStatistics();
+static void taskHostInput();
+static void taskOscCal();
+static void taskPs2();
+static void taskCaptureSample();
+static void taskCaptureSend();
+static void taskKeyboard();
+static void taskMouse();
+static size_t mouseWriteDoneSpace();
+static void taskFlush();
+static void taskJoysticks();
+static void taskOutput();
+static void taskCalibration();
+static void taskCalibrationReport();
+static void taskInitSequences();
+static bool ps2IsHot();
+static bool isIdle();
+static void sleepIfIdle();
+
+// What `loop()` does, in order. Only the urgent tasks run while a PS/2
+// device is part way through a byte.
+static const Task TASKS[] PROGMEM = {
+    { taskHostInput, 0, false },
+    { taskOscCal, 0, false },
+    { taskPs2, 0, true },
+    { taskCaptureSample, 0, true },
+    { taskKeyboard, 0, false },
+    { taskMouse, 0, false },
+    { taskFlush, 0, false },
+    { taskJoysticks, 0, false },
+    { taskCaptureSend, 0, false },
+    { taskOutput, 0, false },
+    { taskCalibration, 0, false },
+    { taskCalibrationReport, 0, false },
+    { taskInitSequences, 0, false },
+};
+
+static Scheduler<sizeof( TASKS ) / sizeof( TASKS[0] )> gScheduler( TASKS,
+                                                                   ps2IsHot );
+
+// Everything for the host queues here first, by where it came from
+static HostOutput<decltype( gUart ), 128, 64, MOUSE_RESERVED_SPACE> gOutput(
+    gUart, formatJoystick );
+
+// Keyboard and mouse bytes wait here, for the `W` command's batch window
+static ReportBatcher gBatcher( reportBytes );
 
 //
 // Functions
@@ -109,282 +258,968 @@ void setup()
 	{
 		// Load OSCCAL
 		OSCCAL = EEPROM.read( EEPROM_ADDR_OSCCAL );
+		gOscCalValid = true;
 	}
+	loadConfig();
 
-	// One of the few 'standard' baud rates you can easily hit from an 8 MHz
-	// clock
-	Serial.begin( 9600 );
-	// Sign-on banner
-	Serial.print( "b020\n" );
+	// Timer1 free-runs at F_CPU / 8, as the tick counter in `ticks.h`. We
+	// don't use its PWM outputs.
+	TCCR1A = 0;
+	TCCR1B = _BV( CS11 );
+
+	// Timer2 in CTC mode gives the joystick sample tick. F_CPU / 64 at 8 MHz
+	// (or / 128 at 16 MHz) is 125 kHz, which divides down exactly to 1 kHz.
+	TCCR2A = _BV( WGM21 );
+#if F_CPU > 8000000L
+	TCCR2B = _BV( CS22 ) | _BV( CS20 );
+	OCR2A = ( F_CPU / 128 / JOYSTICK_SCAN_HZ ) - 1;
+#else
+	TCCR2B = _BV( CS22 );
+	OCR2A = ( F_CPU / 64 / JOYSTICK_SCAN_HZ ) - 1;
+#endif
+	TCNT2 = 0;
+	TIFR2 = _BV( OCF2A );
+	TIMSK2 = _BV( OCIE2A );
 
-	if ( gJs1.scan() )
+	if ( PS2_INTERRUPT_DRIVEN )
+	{
+		// Interrupt on any change of either clock pin. The data pins are
+		// sampled from inside the ISR.
+		enablePinChange<Devices::PS2_PORT>( Devices::PS2_PCINT_MASK );
+	}
+
+	// Idle sleep stops only the CPU, so the timers, USART and pin-change
+	// interrupts all carry on and wake us up
+	set_sleep_mode( SLEEP_MODE_IDLE );
+
+	// Take one unfiltered reading, letting any MegaDrive sequence finish
+	gJs1.scan();
+	while ( gJs1.isSequencing() )
+	{
+		gJs1.scan();
+	}
+	if ( gJs1.has_new() )
 	{
 		JoystickResult test_for_cal_mode = gJs1.read();
 		// Press up and down simultaneously on start-up to enter cal-mode
 		gCalibrationMode = test_for_cal_mode.is_up_pressed() &&
 		                   test_for_cal_mode.is_down_pressed();
 	}
+
+	// Boot at the saved rate, unless OSCCAL hasn't been trimmed for it yet,
+	// or we are about to calibrate (which needs `SYNC_BAUD`, the same 9600)
+	uint32_t baud = HOST_BAUD_RATE;
+	if ( gOscCalValid && !gCalibrationMode )
+	{
+		baud = HOST_BAUD_RATES[gConfig.baud_index];
+	}
+	gUart.begin( baud );
+	// Sign-on banner
+	bufferPrint( F( "b020\n" ) );
+
+	// The rest of the saved settings. The init sequences go out later, from
+	// `taskInitSequences`.
+	gJs1.setDebounce( gConfig.joystick_debounce );
+	gJs2.setDebounce( gConfig.joystick_debounce );
+	gHostProtocol = (HostProtocol)gConfig.protocol;
+	gBatcher.setWindow( gConfig.batch_window_ms );
 	if ( gCalibrationMode )
 	{
 		// The frequency of this output should be 8 MHz / (256 * 64 * 2), or
 		// 244.14 Hz. You need to adjust OSCCAL until you get within 5% for a
 		// functioning UART - the closer the better as it drifts over
 		// temperature.
-		analogWrite( CALIBRATION_OUT, 128 );
+		analogWrite( Board::CALIBRATION_OUT, 128 );
+	}
+	if ( gCalibrationMode )
+	{
+		// Also trim automatically, if the host sends us a sync stream
+		gOscCal.start();
 	}
 }
 
-enum class InputState
+/**
+ * Pin-change interrupt for PORTB. Only used if the board has its PS/2 clock
+ * lines there.
+ */
+ISR( PCINT0_vect )
 {
-	WantCommand,
-	WantHiNibble,
-	WantLoNibble,
-	WantNewline,
-};
+	if ( Devices::PS2_PORT == AvrPort::B )
+	{
+		gPs2Bus.onPinChange();
+	}
+}
 
-static InputState inputState = InputState::WantCommand;
-static char inputTarget;
-static uint8_t inputByte;
+/**
+ * Pin-change interrupt for PORTC, which carries both PS/2 clock lines on
+ * the boards we have so far.
+ */
+ISR( PCINT1_vect )
+{
+	if ( Devices::PS2_PORT == AvrPort::C )
+	{
+		gPs2Bus.onPinChange();
+	}
+}
 
-static void processInput( char inputChar )
+/**
+ * Timer2 compare interrupt - time to sample the joysticks.
+ */
+ISR( TIMER2_COMPA_vect )
 {
-	switch ( inputState )
+	gJoystickTick = true;
+}
+
+/**
+ * Pin-change interrupt for PORTD, used to time the RXD line while
+ * calibrating.
+ */
+ISR( PCINT2_vect )
+{
+	gOscCal.onRxPinChange();
+}
+
+/**
+ * USART Data Register Empty interrupt - send the next byte to the host.
+ */
+ISR( USART_UDRE_vect )
+{
+	gUart.onDataRegisterEmpty();
+}
+
+/**
+ * USART RX Complete interrupt - collect a byte from the host, and parse it
+ * straight into the command queue.
+ */
+ISR( USART_RX_vect )
+{
+	gUart.onReceive();
+}
+
+/**
+ * Carry out a complete command from the host.
+ *
+ * `K` and `M` take one or more bytes, which are queued for the device all
+ * together or not at all. Everything else takes exactly one byte.
+ */
+static void executeCommand( char command,
+                            const uint8_t* data,
+                            uint8_t data_len )
+{
+	if ( command == 'K' )
+	{
+		if ( gKeyboard.writeBuffer( data, data_len ) )
+		{
+			bufferPrintReply( 'K', data, data_len );
+		}
+		else
+		{
+			// No room - nothing was sent
+			bufferPrintReply( 'K', data, 0 );
+		}
+		return;
+	}
+	if ( command == 'M' )
 	{
-		case InputState::WantCommand:
-			if ( ( inputChar == 'K' ) || ( inputChar == 'M' ) )
+		if ( gMouse.writeBuffer( data, data_len ) )
+		{
+			gMouseAssembler.onHostBytes( data, data_len );
+			bufferPrintReply( 'M', data, data_len );
+		}
+		else
+		{
+			bufferPrintReply( 'M', data, 0 );
+		}
+		return;
+	}
+	if ( command == 'E' )
+	{
+		configCommand( data, data_len );
+		return;
+	}
+	if ( data_len != 1 )
+	{
+		return;
+	}
+
+	uint8_t argument = data[0];
+	switch ( command )
+	{
+		case 'P':
+			if ( argument <= (uint8_t)HostProtocol::Binary )
 			{
-				inputTarget = inputChar;
-				inputState = InputState::WantHiNibble;
+				// Acknowledge in ASCII, then switch
+				bufferPrintReply( 'P', argument );
+				gHostProtocol = (HostProtocol)argument;
 			}
 			break;
-		case InputState::WantHiNibble:
-			if ( ( inputChar >= '0' ) && ( inputChar <= '9' ) )
-			{
-				inputByte = ( inputChar - '0' ) << 4;
-				inputState = InputState::WantLoNibble;
-			}
-			else if ( ( inputChar >= 'A' ) && ( inputChar <= 'F' ) )
+		case 'W':
+			// Anything gathered under the old setting goes out first
+			gBatcher.setWindow( argument );
+			bufferPrintReply( 'W', argument );
+			break;
+		case 'D':
+			// Start (or stop) decoding, from a clean slate
+			gKeyboardDecoder.reset();
+			gKeyboardDecode = ( argument != 0 );
+			bufferPrintReply( 'D', argument );
+			break;
+		case 'C':
+			// The host should now send a stream of 'U' characters at
+			// `SYNC_BAUD`, until it sees the `c` indication. Acknowledge at
+			// the old rate, and change once that's gone.
+			bufferPrintReply( 'C', argument );
+			gPendingBaud = OscCalibrator::SYNC_BAUD;
+			gBaudChangePending = true;
+			gOscCal.start();
+			break;
+		case 'Q':
+			reportStatistics();
+			if ( argument != 0 )
 			{
-				inputByte = ( 10 + inputChar - 'A' ) << 4;
-				inputState = InputState::WantLoNibble;
+				clearStatistics();
 			}
-			else if ( ( inputChar >= 'a' ) && ( inputChar <= 'f' ) )
+			break;
+		case 'L':
+			if ( argument <= CAPTURE_MOUSE )
 			{
-				inputByte = ( 10 + inputChar - 'a' ) << 4;
-				inputState = InputState::WantLoNibble;
+				gCapturePort = argument;
+				gCapture.arm();
 			}
 			else
 			{
-				inputState = InputState::WantCommand;
+				argument = CAPTURE_STOP;
+				gCapture.stop();
 			}
+			bufferPrintReply( 'L', argument );
 			break;
-		case InputState::WantLoNibble:
-			if ( ( inputChar >= '0' ) && ( inputChar <= '9' ) )
+		case 'R':
+			if ( ( argument < ( sizeof( HOST_BAUD_RATES ) /
+			                    sizeof( HOST_BAUD_RATES[0] ) ) ) &&
+			     ( gOscCalValid || ( argument == 0 ) ) )
 			{
-				inputByte |= ( inputChar - '0' );
-				inputState = InputState::WantNewline;
-			}
-			else if ( ( inputChar >= 'A' ) && ( inputChar <= 'F' ) )
-			{
-				inputByte |= ( 10 + inputChar - 'A' );
-				inputState = InputState::WantNewline;
-			}
-			else if ( ( inputChar >= 'a' ) && ( inputChar <= 'f' ) )
-			{
-				inputByte |= ( 10 + inputChar - 'a' );
-				inputState = InputState::WantNewline;
+				// Acknowledge at the old rate, and change once that's gone
+				bufferPrintReply( 'R', argument );
+				gPendingBaud = HOST_BAUD_RATES[argument];
+				gBaudChangePending = true;
 			}
 			else
 			{
-				inputState = InputState::WantCommand;
-			}
-			break;
-		case InputState::WantNewline:
-			if ( ( inputChar == '\r' ) || ( inputChar == '\n' ) )
-			{
-				if ( inputTarget == 'K' )
-				{
-					bufferPrint( "K" );
-					bufferPrintHex2( inputByte );
-					bufferPrintln();
-					gKeyboard.writeBuffer( &inputByte, 1 );
-				}
-				else if ( inputTarget == 'M' )
-				{
-					bufferPrint( "M" );
-					bufferPrintHex2( inputByte );
-					bufferPrintln();
-					gKeyboard.writeBuffer( &inputByte, 1 );
-				}
+				bufferPrintReply( 'R', 0xFF );
 			}
-			inputState = InputState::WantCommand;
 			break;
 	}
 }
 
-// the loop function runs over and over again forever
-void loop()
+/**
+ * Store the current OSCCAL value in EEPROM, to be loaded at boot.
+ */
+static void saveOscCal()
 {
-	static uint16_t debounce_count = 0;
-	JoystickResult js1_bits;
-	JoystickResult js2_bits;
+	EEPROM.write( EEPROM_ADDR_MAGIC, EEPROM_MAGIC_BYTE );
+	EEPROM.write( EEPROM_ADDR_OSCCAL, OSCCAL );
+	gOscCalValid = true;
+}
+
+/**
+ * Load the settings from EEPROM, or use the defaults if there aren't any
+ * (or they don't make sense for this build).
+ */
+static void loadConfig()
+{
+	uint8_t block[CONFIG_BLOCK_SIZE];
+	for ( uint8_t i = 0; i < sizeof( block ); i++ )
+	{
+		block[i] = EEPROM.read( EEPROM_ADDR_CONFIG + i );
+	}
+	if ( !configFromBlock( block, gConfig ) || !isConfigUsable( gConfig ) )
+	{
+		setDefaultConfig( gConfig );
+	}
+}
 
-	// Process incoming characters from the host
-	if ( Serial.available() )
+/**
+ * Store the current settings in EEPROM, to be loaded at boot.
+ */
+static void saveConfig()
+{
+	uint8_t block[CONFIG_BLOCK_SIZE];
+	configToBlock( gConfig, block );
+	for ( uint8_t i = 0; i < sizeof( block ); i++ )
 	{
-		char inputChar = Serial.read();
-		processInput( inputChar );
+		EEPROM.update( EEPROM_ADDR_CONFIG + i, block[i] );
 	}
+}
+
+/**
+ * The settings we use when nothing has been saved - the same as a build
+ * without a config block.
+ */
+static void setDefaultConfig( Config& config )
+{
+	memset( &config, 0, sizeof( config ) );
+	config.baud_index = 0;
+	config.protocol = (uint8_t)HostProtocol::Ascii;
+	config.batch_window_ms = ReportBatcher::DISABLED;
+	config.joystick_debounce = JOYSTICK_DEBOUNCE_SAMPLES;
+}
+
+/**
+ * Could we boot with these settings?
+ */
+static bool isConfigUsable( const Config& config )
+{
+	return ( config.baud_index <
+	         ( sizeof( HOST_BAUD_RATES ) / sizeof( HOST_BAUD_RATES[0] ) ) ) &&
+	       ( config.protocol <= (uint8_t)HostProtocol::Binary ) &&
+	       ( config.keyboard_init_length <= CONFIG_MAX_INIT ) &&
+	       ( config.mouse_init_length <= CONFIG_MAX_INIT );
+}
 
-	// Process outbound characters for the host
-	if ( Serial.availableForWrite() )
+/**
+ * Carry out an `E` command.
+ *
+ * `Exx` reads field `xx`, and `Exx` followed by the field's bytes writes
+ * it. Either way the reply is the field number and its bytes. Changes only
+ * take effect at the next boot, once saved with `EFF`. `EFE` puts back the
+ * defaults. A bad field, or a bad value, gets a reply of just `E`.
+ */
+static void configCommand( const uint8_t* data, uint8_t data_len )
+{
+	uint8_t field = data[0];
+	if ( data_len == 1 )
 	{
-		char data;
-		if ( gSerialBuffer.pop( data ) )
+		if ( field == CONFIG_SAVE )
+		{
+			saveConfig();
+			bufferPrintReply( 'E', field );
+			return;
+		}
+		if ( field == CONFIG_DEFAULTS )
 		{
-			Serial.write( data );
+			setDefaultConfig( gConfig );
+			bufferPrintReply( 'E', field );
+			return;
 		}
 	}
+	else
+	{
+		Config changed = gConfig;
+		if ( !configSetField( changed, field, &data[1], data_len - 1 ) ||
+		     !isConfigUsable( changed ) )
+		{
+			bufferPrintReply( 'E', data, 0 );
+			return;
+		}
+		gConfig = changed;
+	}
 
-	// Process the keyboard
-	gKeyboard.poll();
-	int keyboardByte = gKeyboard.readBuffer();
-	if ( keyboardByte >= 0 )
+	uint8_t reply[1 + 1 + CONFIG_MAX_INIT];
+	reply[0] = field;
+	int8_t field_len = configGetField( gConfig, field, &reply[1] );
+	if ( field_len < 0 )
 	{
-		bufferPrint( "k" );
-		bufferPrintHex2( keyboardByte );
-		bufferPrintln();
+		bufferPrintReply( 'E', data, 0 );
+		return;
 	}
+	bufferPrintReply( 'E', reply, 1 + field_len );
+}
 
-	// Process the mouse
-	gMouse.poll();
-	int mouseByte = gMouse.readBuffer();
-	if ( mouseByte >= 0 )
+// the loop function runs over and over again forever
+void loop()
+{
+	uint16_t start = ticksNow();
+	gScheduler.runPass();
+	uint16_t taken = ticksNow() - start;
+	if ( taken > gLoopMaxTicks )
 	{
-		bufferPrint( "m" );
-		bufferPrintHex2( mouseByte );
-		bufferPrintln();
+		gLoopMaxTicks = taken;
 	}
+	if ( gLoopTotalTicks >= LOOP_TOTAL_LIMIT )
+	{
+		// Keep the mean, but make room for more
+		gLoopTotalTicks >>= 1;
+		gLoopPasses >>= 1;
+	}
+	gLoopTotalTicks += taken;
+	gLoopPasses++;
 
-	// Process Joystick 1
-	if ( gJs1.scan() )
+	sleepIfIdle();
+}
+
+/**
+ * Is there nothing to do until the next interrupt? Called with interrupts
+ * off, so it mustn't turn them back on.
+ */
+static bool isIdle()
+{
+	return PS2_INTERRUPT_DRIVEN && !gCalibrationMode && gPs2Bus.isQuiet() &&
+	       gOutput.isEmpty() && gUart.isIdle() && gCommandQueue.isEmpty() &&
+	       !gJoystickTick && !gJs1.isSequencing() && !gJs2.isSequencing() &&
+	       ( gJoystickQuietSamples >= JOYSTICK_IDLE_SAMPLES ) &&
+	       !gBatcher.isOpen() && !gMouseAssembler.hasPacket() &&
+	       !gBaudChangePending &&
+	       ( gOscCal.state() != OscCalState::Measuring ) &&
+	       ( gCapture.state() == CaptureState::Off );
+}
+
+/**
+ * Sleep (in idle mode) until the next interrupt, if there's nothing to do.
+ *
+ * Everything we wait for arrives by interrupt: PS/2 clock edges (which are
+ * handled in the pin-change ISR, so wake-up adds only a few cycles to the
+ * first edge), host characters, the 1 kHz joystick tick and the Arduino
+ * core's Timer0 tick. The joystick lines are sampled on the tick rather
+ * than woken by pin changes, because a MegaDrive pad only shows most of its
+ * buttons while we are driving SELECT.
+ */
+static void sleepIfIdle()
+{
+	// Check and sleep with interrupts off, so an interrupt can't slip in
+	// between the two. SEI always runs one more instruction before any
+	// interrupt, so we are asleep before it is taken.
+	noInterrupts();
+	if ( isIdle() )
+	{
+		sleep_enable();
+		interrupts();
+		sleep_cpu();
+		sleep_disable();
+	}
+	interrupts();
+}
+
+/**
+ * Carry out the commands the RX interrupt has parsed, and switch baud rate
+ * once an `R` or `C` acknowledgement has gone out. Outbound characters are
+ * moved into the UART by `taskOutput`, and sent by the UDRE interrupt.
+ */
+static void taskHostInput()
+{
+	SpscRingBuf<HostCommand, 4>::Span span;
+	while ( ( span = gCommandQueue.contiguousReadable() ).length != 0 )
 	{
-		js1_bits = gJs1.read();
-		bufferPrint( "s" );
-		bufferPrintHex( js1_bits.value() );
-		bufferPrintln();
+		const HostCommand& command = span.data[0];
+		executeCommand( command.command, command.data, command.length );
+		gCommandQueue.consume( 1 );
 	}
 
-	// Process Joystick 2
-	if ( gJs2.scan() )
+	if ( gBaudChangePending && gOutput.isUrgentEmpty() && gUart.isIdle() )
 	{
-		js2_bits = gJs2.read();
-		bufferPrint( "t" );
-		bufferPrintHex( js2_bits.value() );
-		bufferPrintln();
+		gUart.begin( gPendingBaud );
+		gBaudChangePending = false;
 	}
+}
 
-	if ( gCalibrationMode )
+/**
+ * Trim OSCCAL against the host's sync stream.
+ */
+static void taskOscCal()
+{
+	if ( gOscCal.poll() )
 	{
-		// Look at joystick and trim OSCCAL up or down
-		if ( js1_bits.is_a_pressed() )
+		uint8_t status = 0x01;
+		if ( gOscCal.state() == OscCalState::Done )
 		{
-			// Has the A button been down for enough time?
-			if ( debounce_count == DEBOUNCE_LOOPS )
-			{
-				// Yes it has. If the are pressing up, increase OSCCAL.
-				// If they are pressing down, decrease OSCCAL.
-				if ( js1_bits.is_up_pressed() )
-				{
-					OSCCAL++;
-				}
-				else if ( js1_bits.is_down_pressed() )
+			saveOscCal();
+			status = 0x00;
+		}
+		else if ( gOscCal.state() == OscCalState::TimedOut )
+		{
+			status = 0x02;
+		}
+		uint8_t reply[2] = { status, OSCCAL };
+		bufferPrintReply( 'c', reply, sizeof( reply ) );
+	}
+}
+
+/**
+ * Service both PS/2 ports.
+ */
+static void taskPs2()
+{
+	gPs2Bus.poll();
+}
+
+/**
+ * Feed the line capture, if one is running, with the lines of the port it's
+ * watching.
+ */
+static void taskCaptureSample()
+{
+	CaptureState state = gCapture.state();
+	if ( ( state != CaptureState::Armed ) &&
+	     ( state != CaptureState::Capturing ) )
+	{
+		return;
+	}
+	uint8_t pins = readPort<Devices::PS2_PORT>();
+	uint8_t clk_mask = ( gCapturePort == CAPTURE_KEYBOARD )
+	                       ? pinMask( Devices::Keyboard::CLK_PIN )
+	                       : pinMask( Devices::Mouse::CLK_PIN );
+	uint8_t dat_mask = ( gCapturePort == CAPTURE_KEYBOARD )
+	                       ? pinMask( Devices::Keyboard::DAT_PIN )
+	                       : pinMask( Devices::Mouse::DAT_PIN );
+	uint8_t lines = 0;
+	if ( pins & clk_mask )
+	{
+		lines |= LineCapture<CAPTURE_RUNS>::LINE_CLK;
+	}
+	if ( pins & dat_mask )
+	{
+		lines |= LineCapture<CAPTURE_RUNS>::LINE_DAT;
+	}
+	gCapture.sample( lines, ticksNow() );
+}
+
+/**
+ * Send a finished capture to the host, a `w` line at a time as there's
+ * room, then an empty `w` line to mark the end.
+ */
+static void taskCaptureSend()
+{
+	while ( ( gCapture.state() == CaptureState::Done ) &&
+	        ( gOutput.urgentSpaceAvailable() >= CAPTURE_LINE_SPACE ) )
+	{
+		uint16_t runs[CAPTURE_RUNS_PER_LINE];
+		uint8_t count = gCapture.read( runs, CAPTURE_RUNS_PER_LINE );
+		uint8_t line[2 * CAPTURE_RUNS_PER_LINE];
+		uint8_t* p = line;
+		for ( uint8_t i = 0; i < count; i++ )
+		{
+			p = putWord( p, runs[i] );
+		}
+		bufferPrintReply( 'w', line, p - line );
+		if ( count == 0 )
+		{
+			gCapture.stop();
+		}
+	}
+}
+
+/**
+ * Is a PS/2 device part way through a byte?
+ */
+static bool ps2IsHot()
+{
+	return gPs2Bus.isActive();
+}
+
+/**
+ * Pass on what the keyboard has sent, and how its commands went.
+ */
+static void taskKeyboard()
+{
+	int keyboardByte;
+	while ( ( keyboardByte = gKeyboard.readBuffer() ) >= 0 )
+	{
+		if ( !gKeyboardDecode )
+		{
+			gBatcher.add( Report::Keyboard, keyboardByte, millis() );
+			continue;
+		}
+		uint8_t key;
+		switch ( gKeyboardDecoder.feed( keyboardByte, key ) )
+		{
+			case KeyboardDecodeResult::Nothing:
+				break;
+			case KeyboardDecodeResult::Raw:
+				gBatcher.add( Report::Keyboard, keyboardByte, millis() );
+				break;
+			case KeyboardDecodeResult::Pressed:
+				reportKey( Report::KeyPressed, key );
+				break;
+			case KeyboardDecodeResult::Released:
+				reportKey( Report::KeyReleased, key );
+				break;
+			case KeyboardDecodeResult::PressedAndReleased:
+				reportKey( Report::KeyPressed, key );
+				reportKey( Report::KeyReleased, key );
+				break;
+			case KeyboardDecodeResult::Reset:
+				// Let go of anything held from before, so it isn't stuck
+				while ( gKeyboardDecoder.takeHeldKey( key ) )
 				{
-					OSCCAL--;
+					reportKey( Report::KeyReleased, key );
 				}
-				debounce_count++;
-			}
-			else if ( debounce_count < DEBOUNCE_LOOPS )
-			{
-				debounce_count++;
-			}
+				gBatcher.add( Report::Keyboard, keyboardByte, millis() );
+				break;
 		}
-		else
+	}
+
+	Ps2WriteResult write_result;
+	while ( gKeyboard.readCompletion( write_result ) )
+	{
+		reportWriteDone( WRITE_DONE_KEYBOARD, write_result );
+	}
+}
+
+/**
+ * Pass on what the mouse has sent, and how its commands went.
+ */
+static void taskMouse()
+{
+	int mouseByte;
+	while ( ( mouseByte = gMouse.readBuffer() ) >= 0 )
+	{
+		if ( gMouseAssembler.feed( mouseByte ) )
 		{
-			debounce_count = 0;
+			gBatcher.add( Report::Mouse, mouseByte, millis() );
 		}
-		if ( js1_bits.is_start_pressed() )
+	}
+	// Movement packets only go out when there's room for them. Until then,
+	// the assembler adds them together.
+	while ( gMouseAssembler.hasPacket() &&
+	        ( gOutput.mousePacketSpace() >= MOUSE_PACKET_SPACE ) )
+	{
+		uint8_t packet[4];
+		uint8_t packet_len = gMouseAssembler.takePacket( packet );
+		for ( uint8_t i = 0; i < packet_len; i++ )
 		{
-			EEPROM.write( EEPROM_ADDR_MAGIC, EEPROM_MAGIC_BYTE );
-			EEPROM.write( EEPROM_ADDR_OSCCAL, OSCCAL );
-			while ( 1 )
-			{
-				// Lock up once we've saved the EEPROM
-				bufferPrintln( "RESET ME" );
-			}
+			gBatcher.add( Report::Mouse, packet[i], millis() );
+		}
+	}
+
+	// A write-done has to go in the mouse lane, after any ACKs still being
+	// batched. Until there's room for them all, it waits in the port's
+	// completion queue rather than being dropped.
+	Ps2WriteResult write_result;
+	while ( ( gOutput.mouseSpaceAvailable() >= mouseWriteDoneSpace() ) &&
+	        gMouse.readCompletion( write_result ) )
+	{
+		reportWriteDone( WRITE_DONE_MOUSE, write_result );
+	}
+}
+
+/**
+ * How much room `reportWriteDone` needs in the mouse lane - the write-done
+ * line, and any batched mouse bytes it flushes out ahead of it.
+ */
+static size_t mouseWriteDoneSpace()
+{
+	size_t space = MOUSE_WRITE_DONE_SPACE;
+	uint8_t batched = gBatcher.length( Report::Mouse );
+	if ( batched != 0 )
+	{
+		// The ASCII line, and the write-done's length byte
+		space += 1 + ( 2 * batched ) + 1 + 1;
+	}
+	return space;
+}
+
+/**
+ * Send anything gathered so far, if the batch window has closed.
+ */
+static void taskFlush()
+{
+	gBatcher.flushIfDue( millis() );
+}
+
+/**
+ * Sample the joysticks once per tick, but keep stepping any MegaDrive SELECT
+ * sequence at full speed until it's done. If we miss a tick because the loop
+ * was busy, we just sample late.
+ */
+static void taskJoysticks()
+{
+	bool joystick_tick = gJoystickTick;
+	if ( joystick_tick )
+	{
+		gJoystickTick = false;
+	}
+
+	if ( joystick_tick && ( gJoystickQuietSamples < JOYSTICK_IDLE_SAMPLES ) )
+	{
+		gJoystickQuietSamples++;
+	}
+
+	if ( ( joystick_tick || gJs1.isSequencing() ) && gJs1.scan() )
+	{
+		gJs1Bits = gJs1.read();
+		gOutput.setJoystick( 0, gJs1Bits.value() );
+		gJoystickQuietSamples = 0;
+	}
+
+	if ( ( joystick_tick || gJs2.isSequencing() ) && gJs2.scan() )
+	{
+		JoystickResult js2_bits = gJs2.read();
+		gOutput.setJoystick( 1, js2_bits.value() );
+		gJoystickQuietSamples = 0;
+	}
+}
+
+/**
+ * Move whatever output will fit into the UART, most important first.
+ */
+static void taskOutput()
+{
+	if ( gBaudChangePending && gOutput.isUrgentEmpty() )
+	{
+		// The `R` or `C` reply has gone - hold everything else back until
+		// we're at the new rate
+		return;
+	}
+	gOutput.poll();
+}
+
+/**
+ * In calibration mode, look at joystick 1 and trim OSCCAL up or down.
+ */
+static void taskCalibration()
+{
+	static bool debounce_held = false;
+	static uint16_t debounce_start = 0;
+
+	if ( !gCalibrationMode )
+	{
+		return;
+	}
+	if ( !gJs1Bits.is_a_pressed() )
+	{
+		debounce_held = false;
+		debounce_start = ticksNow();
+	}
+	else if ( !debounce_held &&
+	          ( ( uint16_t )( ticksNow() - debounce_start ) >=
+	            CAL_DEBOUNCE_TICKS ) )
+	{
+		// The A button has been down for long enough. If they are pressing
+		// up, increase OSCCAL. If they are pressing down, decrease OSCCAL.
+		// Only once per press.
+		if ( gJs1Bits.is_up_pressed() )
+		{
+			OSCCAL++;
+		}
+		else if ( gJs1Bits.is_down_pressed() )
+		{
+			OSCCAL--;
+		}
+		debounce_held = true;
+	}
+	if ( gJs1Bits.is_start_pressed() )
+	{
+		saveOscCal();
+		while ( 1 )
+		{
+			// Lock up once we've saved the EEPROM
+			bufferPrint( F( "RESET ME\n" ) );
+			gOutput.poll();
 		}
-		// Whatever happens, print out the current OSCCAL
-		bufferPrint( "O" );
-		bufferPrintHex( OSCCAL );
-		bufferPrintln();
 	}
 }
 
 /**
- * Print to the serial buffer.
+ * In calibration mode, print out the current OSCCAL.
  */
-static void bufferPrint( const String& s )
+static void taskCalibrationReport()
 {
-	for ( char const& c : s )
+	static unsigned long last_report = 0;
+
+	if ( !gCalibrationMode || ( ( millis() - last_report ) < CAL_REPORT_MS ) )
+	{
+		return;
+	}
+	last_report = millis();
+	uint8_t reply[2] = { 0x00, OSCCAL };
+	bufferPrintReply( 'O', reply, sizeof( reply ) );
+}
+
+/**
+ * Send the saved init sequences to the keyboard and mouse, once, after
+ * they've had time to start up. The replies come back to the host as if it
+ * had sent `K` and `M` commands itself.
+ */
+static void taskInitSequences()
+{
+	if ( gInitSequencesSent || ( millis() < PS2_INIT_DELAY_MS ) )
+	{
+		return;
+	}
+	gInitSequencesSent = true;
+	if ( gConfig.keyboard_init_length != 0 )
+	{
+		gKeyboard.writeBuffer( gConfig.keyboard_init,
+		                       gConfig.keyboard_init_length );
+	}
+	if ( ( gConfig.mouse_init_length != 0 ) &&
+	     gMouse.writeBuffer( gConfig.mouse_init, gConfig.mouse_init_length ) )
 	{
-		gSerialBuffer.push( c );
+		gMouseAssembler.onHostBytes( gConfig.mouse_init,
+		                             gConfig.mouse_init_length );
 	}
 }
 
 /**
- * Print a newline.
+ * Send a one byte indication to the host.
+ */
+static void reportByte( Report source, uint8_t value )
+{
+	reportBytes( source, &value, 1 );
+}
+
+/**
+ * Send an indication to the host. Mouse bytes can be held back, so they
+ * have a lane of their own, and everything else goes first.
  */
-static void bufferPrintln()
+static void reportBytes( Report source, const uint8_t* data, uint8_t data_len )
 {
-	bufferPrint( "\n" );
+	OutputLane lane =
+	    ( source == Report::Mouse ) ? OutputLane::Mouse : OutputLane::Urgent;
+	reportBytes( lane, source, data, data_len );
 }
 
 /**
- * Print a string, then a newline.
+ * Send an indication to the host, as one message in `lane`.
  */
-static void bufferPrintln( const String& s )
+static void reportBytes( OutputLane lane,
+                         Report source,
+                         const uint8_t* data,
+                         uint8_t data_len )
 {
-	bufferPrint( s );
-	bufferPrint( "\n" );
+	char message[REPORT_MAX_MESSAGE];
+	uint8_t message_len =
+	    formatReport( gHostProtocol, source, data, data_len, message );
+	gOutput.send( lane, message, message_len );
 }
 
 /**
- * Print a 16-bit word as four hex nibbles, big-endian.
+ * Build a joystick indication, for `gOutput` to send. This happens when
+ * it's sent rather than when the joystick changed, so it's always in the
+ * current protocol.
  */
-static void bufferPrintHex( uint16_t value )
+static uint8_t formatJoystick( uint8_t joystick, uint16_t state, char* out )
 {
-	gSerialBuffer.push( wordToHex( value, 3 ) );
-	gSerialBuffer.push( wordToHex( value, 2 ) );
-	gSerialBuffer.push( wordToHex( value, 1 ) );
-	gSerialBuffer.push( wordToHex( value, 0 ) );
+	uint8_t data[2] = { (uint8_t)( state >> 8 ), (uint8_t)state };
+	Report source = ( joystick == 0 ) ? Report::Joystick1 : Report::Joystick2;
+	return formatReport( gHostProtocol, source, data, sizeof( data ), out );
 }
 
 /**
- * Print an 8-bit byte as two hex nibbles, big-endian.
+ * Send a decoded key to the host. Any raw bytes still being batched (like
+ * the ACK of an earlier command) go first, so the host sees them in the
+ * order they came off the wire.
  */
-static void bufferPrintHex2( uint8_t value )
+static void reportKey( Report source, uint8_t key )
 {
-	gSerialBuffer.push( wordToHex( value, 1 ) );
-	gSerialBuffer.push( wordToHex( value, 0 ) );
+	gBatcher.flushAll();
+	reportByte( source, key );
 }
 
 /**
- * Convert 4 bits from an integer to a single hex nibble.
+ * Tell the host a `K` or `M` command has finished.
  */
-static char wordToHex( uint16_t value, uint8_t nibble_idx )
+static void reportWriteDone( uint8_t device, Ps2WriteResult result )
 {
-	static const char hexNibbles[] = { '0', '1', '2', '3', '4', '5', '6', '7',
-	                                   '8', '9', 'A', 'B', 'C', 'D', 'E', 'F' };
-	uint8_t nibble = ( value >> ( 4 * nibble_idx ) ) & 0x000F;
-	return hexNibbles[nibble];
+	// Make sure the ACKs go out first - and a mouse's ACKs are in the mouse
+	// lane, so that's where this has to go too
+	gBatcher.flushAll();
+	uint8_t data[2] = { device, (uint8_t)result };
+	OutputLane lane =
+	    ( device == WRITE_DONE_MOUSE ) ? OutputLane::Mouse : OutputLane::Urgent;
+	reportBytes( lane, Report::WriteDone, data, sizeof( data ) );
+}
+
+/**
+ * Put a 16-bit value into a buffer, big-endian.
+ */
+static uint8_t* putWord( uint8_t* out, uint16_t value )
+{
+	out[0] = value >> 8;
+	out[1] = value & 0xFF;
+	return out + 2;
+}
+
+/**
+ * Answer a `Q` command with the loop timing and error counters.
+ */
+static void reportStatistics()
+{
+	uint32_t mean = 0;
+	if ( gLoopPasses != 0 )
+	{
+		mean = gLoopTotalTicks / gLoopPasses;
+	}
+	if ( mean > UINT16_MAX )
+	{
+		mean = UINT16_MAX;
+	}
+	Ps2Counters keyboard = gKeyboard.counters();
+	Ps2Counters mouse = gMouse.counters();
+
+	uint8_t reply[MAX_REPLY_BYTES];
+	uint8_t* p = reply;
+	p = putWord( p, gLoopMaxTicks );
+	p = putWord( p, mean );
+	p = putWord( p, keyboard.word_errors );
+	p = putWord( p, keyboard.timeouts );
+	p = putWord( p, keyboard.buffer_full );
+	p = putWord( p, mouse.word_errors );
+	p = putWord( p, mouse.timeouts );
+	p = putWord( p, mouse.buffer_full );
+	p = putWord( p, gOutput.dropped() + gUart.dropped() );
+	p = putWord( p, gCommandParser.dropped() );
+	bufferPrintReply( 'Q', reply, p - reply );
+}
+
+/**
+ * Start counting again from zero.
+ */
+static void clearStatistics()
+{
+	gLoopMaxTicks = 0;
+	gLoopTotalTicks = 0;
+	gLoopPasses = 0;
+	gKeyboard.clearCounters();
+	gMouse.clearCounters();
+	gOutput.clearDropped();
+	gUart.clearDropped();
+	gCommandParser.clearDropped();
+}
+
+/**
+ * Print a string from flash (wrap literals in `F()`), as one urgent message.
+ */
+static void bufferPrint( const __FlashStringHelper* s )
+{
+	PGM_P p = reinterpret_cast<PGM_P>( s );
+	char message[decltype( gOutput )::MAX_MESSAGE];
+	uint8_t message_len = 0;
+	char c;
+	while ( ( c = pgm_read_byte( p++ ) ) != '\0' )
+	{
+		assert( message_len < sizeof( message ) );
+		message[message_len++] = c;
+	}
+	gOutput.send( OutputLane::Urgent, message, message_len );
+}
+
+/**
+ * Print the reply to a host command - the command letter, a hex byte and a
+ * newline.
+ */
+static void bufferPrintReply( char command, uint8_t value )
+{
+	char reply[4] = { command, 0, 0, '\n' };
+	hexEncode( value, &reply[1] );
+	gOutput.send( OutputLane::Urgent, reply, sizeof( reply ) );
+}
+
+/**
+ * Print the reply to a host command that carries several bytes.
+ */
+static void bufferPrintReply( char command,
+                              const uint8_t* data,
+                              uint8_t data_len )
+{
+	assert( data_len <= MAX_REPLY_BYTES );
+	char reply[1 + ( 2 * MAX_REPLY_BYTES ) + 1];
+	uint8_t reply_len = 0;
+	reply[reply_len++] = command;
+	for ( uint8_t i = 0; i < data_len; i++ )
+	{
+		hexEncode( data[i], &reply[reply_len] );
+		reply_len += 2;
+	}
+	reply[reply_len++] = '\n';
+	gOutput.send( OutputLane::Urgent, reply, reply_len );
 }
@@ -46,6 +46,7 @@
 #define __RINGBUF_H__
 
 #include <Arduino.h>
+#include <string.h>
 
 /*
  * Set the integer size used to store the size of the buffer according of
@@ -103,6 +104,13 @@ class RingBuf
 	IT writeIndex();
 
    public:
+	/* A run of elements that sit next to each other in the buffer */
+	struct Span
+	{
+		ET* data;
+		IT length;
+	};
+
 	/* Constructor. Init mReadIndex to 0 and mSize to 0 */
 	RingBuf();
 	/* Push a data at the end of the buffer */
@@ -120,6 +128,21 @@ class RingBuf
 	bool peek( ET& outElement ) __attribute__( ( noinline ) );
 	/* Pop the data at the beginning of the buffer with interrupt disabled */
 	bool lockedPop( ET& outElement );
+	/* Push as many of the given data as will fit. Return how many went in */
+	IT pushN( const ET* inElements, size_t inCount )
+	    __attribute__( ( noinline ) );
+	/* Pop up to inCount data. Return how many came out */
+	IT popN( ET* outElements, size_t inCount ) __attribute__( ( noinline ) );
+	/* Return the longest run of data that can be read in place, without
+	 * copying it out. Use consume() once you are done with it */
+	Span contiguousReadable();
+	/* Drop data from the beginning of the buffer, once read in place */
+	void consume( IT inCount );
+	/* Return the longest run of free space that can be written in place.
+	 * Use commit() once you have filled it */
+	Span contiguousWritable();
+	/* Add data written in place to the end of the buffer */
+	void commit( IT inCount );
 	/* Return true if the buffer is full */
 	bool isFull() { return mSize == S; }
 	/* Return true if the buffer is empty */
@@ -217,6 +240,83 @@ bool RingBuf<ET, S, IT, BT>::lockedPop( ET& outElement )
 	return result;
 }
 
+template <typename ET, size_t S, typename IT, typename BT>
+IT RingBuf<ET, S, IT, BT>::pushN( const ET* inElements, size_t inCount )
+{
+	IT count = 0;
+	while ( ( count < inCount ) && !isFull() )
+	{
+		Span span = contiguousWritable();
+		if ( span.length > inCount - count )
+			span.length = inCount - count;
+		memcpy( span.data, &inElements[count], span.length * sizeof( ET ) );
+		mSize += span.length;
+		count += span.length;
+	}
+	return count;
+}
+
+template <typename ET, size_t S, typename IT, typename BT>
+IT RingBuf<ET, S, IT, BT>::popN( ET* outElements, size_t inCount )
+{
+	IT count = 0;
+	while ( ( count < inCount ) && !isEmpty() )
+	{
+		Span span = contiguousReadable();
+		if ( span.length > inCount - count )
+			span.length = inCount - count;
+		memcpy( &outElements[count], span.data, span.length * sizeof( ET ) );
+		consume( span.length );
+		count += span.length;
+	}
+	return count;
+}
+
+template <typename ET, size_t S, typename IT, typename BT>
+typename RingBuf<ET, S, IT, BT>::Span
+RingBuf<ET, S, IT, BT>::contiguousReadable()
+{
+	Span result;
+	result.data = &mBuffer[mReadIndex];
+	result.length = S - mReadIndex;
+	if ( result.length > mSize )
+		result.length = mSize;
+	return result;
+}
+
+template <typename ET, size_t S, typename IT, typename BT>
+void RingBuf<ET, S, IT, BT>::consume( IT inCount )
+{
+	if ( inCount > mSize )
+		inCount = mSize;
+	BT ri = (BT)mReadIndex + (BT)inCount;
+	if ( ri >= (BT)S )
+		ri -= (BT)S;
+	mReadIndex = (IT)ri;
+	mSize -= inCount;
+}
+
+template <typename ET, size_t S, typename IT, typename BT>
+typename RingBuf<ET, S, IT, BT>::Span
+RingBuf<ET, S, IT, BT>::contiguousWritable()
+{
+	IT wi = writeIndex();
+	Span result;
+	result.data = &mBuffer[wi];
+	result.length = S - wi;
+	if ( result.length > S - mSize )
+		result.length = S - mSize;
+	return result;
+}
+
+template <typename ET, size_t S, typename IT, typename BT>
+void RingBuf<ET, S, IT, BT>::commit( IT inCount )
+{
+	if ( inCount > S - mSize )
+		inCount = S - mSize;
+	mSize += inCount;
+}
+
 template <typename ET, size_t S, typename IT, typename BT>
 ET& RingBuf<ET, S, IT, BT>::operator[]( IT inIndex )
 {
@@ -228,4 +328,218 @@ ET& RingBuf<ET, S, IT, BT>::operator[]( IT inIndex )
 	return mBuffer[(IT)index];
 }
 
+/*
+ * Lock-free single-producer / single-consumer ring buffer
+ *
+ * For passing data between one interrupt handler and the main loop (in either
+ * direction) without disabling interrupts. The write index is only ever
+ * written by the producer and the read index only by the consumer. Both are
+ * a single byte, so the other side always reads them in one go, and a
+ * compiler barrier makes sure the element itself is in memory before the
+ * index that publishes it is moved on.
+ *
+ * The size must be a power of two up to 256, so wrapping round is a mask.
+ * One slot is always left empty to tell full from empty, so the buffer holds
+ * S - 1 elements.
+ */
+
+template <typename ET, size_t S>
+class SpscRingBuf
+{
+	/*
+	 * check the size is a power of two, otherwise emit a compile time error
+	 */
+	static_assert( ( S >= 2 ) && ( ( S & ( S - 1 ) ) == 0 ),
+	               "SpscRingBuf size must be a power of two" );
+
+	/*
+	 * check the indices fit in one byte, otherwise emit a compile time error
+	 */
+	static_assert( S <= 256,
+	               "SpscRingBuf with size greater than 256 are forbidden" );
+
+   private:
+	static constexpr uint8_t MASK = S - 1;
+
+	ET mBuffer[S];
+	volatile uint8_t mWriteIndex;
+	volatile uint8_t mReadIndex;
+
+	static void barrier() { __asm__ __volatile__( "" ::: "memory" ); }
+
+   public:
+	/* A run of elements that sit next to each other in the buffer */
+	struct Span
+	{
+		ET* data;
+		uint8_t length;
+	};
+
+	/* Constructor. Init both indices to 0 */
+	SpscRingBuf();
+	/* Push a data at the end of the buffer. Producer only */
+	bool push( const ET inElement );
+	/* Pop the data at the beginning of the buffer. Consumer only */
+	bool pop( ET& outElement );
+	/* Peek at the data at the beginning of the buffer. Consumer only */
+	bool peek( ET& outElement );
+	/* Push as many of the given data as will fit. Return how many went in.
+	 * Producer only */
+	uint8_t pushN( const ET* inElements, size_t inCount );
+	/* Pop up to inCount data. Return how many came out. Consumer only */
+	uint8_t popN( ET* outElements, size_t inCount );
+	/* Return the longest run of data that can be read in place, without
+	 * copying it out. Use consume() once you are done with it. Consumer
+	 * only */
+	Span contiguousReadable();
+	/* Drop data from the beginning of the buffer, once read in place.
+	 * Consumer only */
+	void consume( uint8_t inCount );
+	/* Return the longest run of free space that can be written in place.
+	 * Use commit() once you have filled it. Producer only */
+	Span contiguousWritable();
+	/* Add data written in place to the end of the buffer. Producer only */
+	void commit( uint8_t inCount );
+	/* Return true if the buffer is full */
+	bool isFull() { return ( ( mWriteIndex + 1 ) & MASK ) == mReadIndex; }
+	/* Return true if the buffer is empty */
+	bool isEmpty() { return mWriteIndex == mReadIndex; }
+	/* Reset the buffer to an empty state. Consumer only */
+	void clear() { mReadIndex = mWriteIndex; }
+	/* return the size of the buffer */
+	uint8_t size() { return ( mWriteIndex - mReadIndex ) & MASK; }
+	/* return the maximum size of the buffer */
+	uint8_t maxSize() { return S - 1; }
+};
+
+template <typename ET, size_t S>
+SpscRingBuf<ET, S>::SpscRingBuf() : mWriteIndex( 0 ), mReadIndex( 0 )
+{
+}
+
+template <typename ET, size_t S>
+bool SpscRingBuf<ET, S>::push( const ET inElement )
+{
+	uint8_t wi = mWriteIndex;
+	uint8_t next = ( wi + 1 ) & MASK;
+	if ( next == mReadIndex )
+		return false;
+	mBuffer[wi] = inElement;
+	barrier();
+	mWriteIndex = next;
+	return true;
+}
+
+template <typename ET, size_t S>
+bool SpscRingBuf<ET, S>::pop( ET& outElement )
+{
+	uint8_t ri = mReadIndex;
+	if ( ri == mWriteIndex )
+		return false;
+	outElement = mBuffer[ri];
+	barrier();
+	mReadIndex = ( ri + 1 ) & MASK;
+	return true;
+}
+
+template <typename ET, size_t S>
+bool SpscRingBuf<ET, S>::peek( ET& outElement )
+{
+	uint8_t ri = mReadIndex;
+	if ( ri == mWriteIndex )
+		return false;
+	outElement = mBuffer[ri];
+	return true;
+}
+
+template <typename ET, size_t S>
+uint8_t SpscRingBuf<ET, S>::pushN( const ET* inElements, size_t inCount )
+{
+	uint8_t count = 0;
+	while ( count < inCount )
+	{
+		Span span = contiguousWritable();
+		if ( span.length == 0 )
+			break;
+		if ( span.length > inCount - count )
+			span.length = inCount - count;
+		memcpy( span.data, &inElements[count], span.length * sizeof( ET ) );
+		commit( span.length );
+		count += span.length;
+	}
+	return count;
+}
+
+template <typename ET, size_t S>
+uint8_t SpscRingBuf<ET, S>::popN( ET* outElements, size_t inCount )
+{
+	uint8_t count = 0;
+	while ( count < inCount )
+	{
+		Span span = contiguousReadable();
+		if ( span.length == 0 )
+			break;
+		if ( span.length > inCount - count )
+			span.length = inCount - count;
+		memcpy( &outElements[count], span.data, span.length * sizeof( ET ) );
+		consume( span.length );
+		count += span.length;
+	}
+	return count;
+}
+
+template <typename ET, size_t S>
+typename SpscRingBuf<ET, S>::Span SpscRingBuf<ET, S>::contiguousReadable()
+{
+	uint8_t ri = mReadIndex;
+	uint8_t wi = mWriteIndex;
+	Span result;
+	result.data = &mBuffer[ri];
+	if ( wi >= ri )
+		result.length = wi - ri;
+	else
+		result.length = S - ri;
+	return result;
+}
+
+template <typename ET, size_t S>
+void SpscRingBuf<ET, S>::consume( uint8_t inCount )
+{
+	uint8_t ri = mReadIndex;
+	uint8_t available = ( mWriteIndex - ri ) & MASK;
+	if ( inCount > available )
+		inCount = available;
+	barrier();
+	mReadIndex = ( ri + inCount ) & MASK;
+}
+
+template <typename ET, size_t S>
+typename SpscRingBuf<ET, S>::Span SpscRingBuf<ET, S>::contiguousWritable()
+{
+	uint8_t wi = mWriteIndex;
+	uint8_t ri = mReadIndex;
+	Span result;
+	result.data = &mBuffer[wi];
+	if ( ri > wi )
+		// Up to the slot before the read index
+		result.length = ri - wi - 1;
+	else if ( ri == 0 )
+		// Up to the end, but not into the last slot
+		result.length = S - wi - 1;
+	else
+		result.length = S - wi;
+	return result;
+}
+
+template <typename ET, size_t S>
+void SpscRingBuf<ET, S>::commit( uint8_t inCount )
+{
+	uint8_t wi = mWriteIndex;
+	uint8_t space = ( mReadIndex - wi - 1 ) & MASK;
+	if ( inCount > space )
+		inCount = space;
+	barrier();
+	mWriteIndex = ( wi + inCount ) & MASK;
+}
+
 #endif /* __RINGBUF_H__ */
@@ -0,0 +1,8 @@
+#!/bin/sh
+echo "Compiling..."
+g++ -O2 -o ./bench ./tests/bench.cpp -I. -I./tests || exit 1
+echo "Running..."
+./bench "$@" > bench_output.txt
+status=$?
+cat bench_output.txt
+exit $status
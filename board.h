@@ -0,0 +1,93 @@
+/**
+ * Neotron-IO board profiles.
+ *
+ * Each supported board is a struct of `static constexpr` Arduino pin
+ * numbers. `BoardDevices` turns a profile into the types of every device on
+ * it, and works out the PS/2 pin-change masks and PCINT group, so a new
+ * board (or revision) only needs a new profile - all the port and bit
+ * arithmetic is done at compile time by `port.h`, and each device is a
+ * template specialised on its own pins.
+ *
+ * Include this after `joystick.h`, `ps2.h` and `ps2bus.h`.
+ *
+ * This project is also licensed under the GPL (v3 or later version, at your
+ * choice). See the [LICENCE](./LICENCE) file.
+ */
+
+#include "port.h"
+
+/**
+ * An Arduino Uno (or anything else with a crystal on PB6 / PB7).
+ */
+struct BoardArduinoUno
+{
+	// Pins D0 and D1 are for the UART
+	static constexpr int JS1_START_C = 2;
+	static constexpr int JS1_GND_RIGHT = 3;
+	static constexpr int JS1_GND_LEFT = 4;
+	static constexpr int JS1_DOWN = 5;
+	static constexpr int JS1_AB = 6;
+	static constexpr int JS1_UP = 7;
+	static constexpr int JS1_SELECT = A5;
+
+	static constexpr int JS2_AB = 8;
+	static constexpr int JS2_UP = 9;
+	static constexpr int JS2_START_C = 10;
+	static constexpr int JS2_GND_RIGHT = 11;
+	static constexpr int JS2_GND_LEFT = 12;
+	static constexpr int JS2_DOWN = 13;
+	static constexpr int JS2_SELECT = A4;
+
+	static constexpr int KB_CLK = A0;
+	static constexpr int KB_DAT = A1;
+	static constexpr int MS_CLK = A2;
+	static constexpr int MS_DAT = A3;
+
+	/// Where the square wave goes in calibration mode
+	static constexpr int CALIBRATION_OUT = MS_DAT;
+};
+
+/**
+ * The Neotron 32. There's no crystal, so joystick 2 uses the XTAL pins.
+ */
+struct BoardNeotron32 : BoardArduinoUno
+{
+	static constexpr int JS2_AB = 20;
+	static constexpr int JS2_UP = 21;
+};
+
+/**
+ * Everything attached to a board, as types.
+ */
+template <typename BOARD, bool PS2_INTERRUPT_DRIVEN>
+struct BoardDevices
+{
+	using Joystick1 = Joystick<BOARD::JS1_UP,
+	                           BOARD::JS1_DOWN,
+	                           BOARD::JS1_GND_LEFT,
+	                           BOARD::JS1_GND_RIGHT,
+	                           BOARD::JS1_AB,
+	                           BOARD::JS1_START_C,
+	                           BOARD::JS1_SELECT>;
+	using Joystick2 = Joystick<BOARD::JS2_UP,
+	                           BOARD::JS2_DOWN,
+	                           BOARD::JS2_GND_LEFT,
+	                           BOARD::JS2_GND_RIGHT,
+	                           BOARD::JS2_AB,
+	                           BOARD::JS2_START_C,
+	                           BOARD::JS2_SELECT>;
+	// Edges always come from the bus, so the ports are always 'interrupt
+	// driven'
+	using Keyboard = Ps2<BOARD::KB_CLK, BOARD::KB_DAT, true>;
+	using Mouse = Ps2<BOARD::MS_CLK, BOARD::MS_DAT, true>;
+	using Bus = Ps2Bus<Keyboard, Mouse, PS2_INTERRUPT_DRIVEN>;
+
+	/// The port (and so the PCINT group) both PS/2 clocks are on
+	static constexpr AvrPort PS2_PORT = pinPort( BOARD::KB_CLK );
+	/// The pin-change interrupts we want - just the two clocks
+	static constexpr uint8_t PS2_PCINT_MASK =
+	    pinMask( BOARD::KB_CLK ) | pinMask( BOARD::MS_CLK );
+
+	static_assert( PS2_PORT != AvrPort::D,
+	               "PORTD's pin-change interrupt is used to time RXD" );
+};
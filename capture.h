@@ -0,0 +1,178 @@
+/**
+ * Neotron-IO PS/2 line capture.
+ *
+ * For finding out what a misbehaving device is really doing on the wire,
+ * without a logic analyser. Once armed, `sample` is given the CLK and DAT
+ * levels of one port on every pass of `loop()`, and records how long they
+ * stayed the same, as a list of runs. Nothing is recorded until the first
+ * sample with either line low (both idle high), so the capture starts at
+ * the first edge. It stops when the buffer is full, or once both lines
+ * have been high for `MAX_RUN` ticks.
+ *
+ * Each run is one 16-bit word: CLK in bit 15, DAT in bit 14, and the number
+ * of ticks the lines stayed like that in the rest. A longer run is split
+ * into several words with the same levels.
+ *
+ * Samples are only as close together as `loop()` passes, so this can miss
+ * glitches shorter than a pass - but while a port is part way through a
+ * byte, only the urgent tasks run, and those are quick.
+ *
+ * This project is also licensed under the GPL (v3 or later version, at your
+ * choice). See the [LICENCE](./LICENCE) file.
+ */
+
+enum class CaptureState : uint8_t
+{
+	/// Not capturing
+	Off,
+	/// Waiting for the first edge
+	Armed,
+	/// Recording runs
+	Capturing,
+	/// Finished - waiting for the runs to be `read` out
+	Done,
+};
+
+/**
+ * A run-length encoded capture of two lines.
+ */
+template <uint8_t N>
+class LineCapture
+{
+   public:
+	/// Bit 1 is CLK, bit 0 is DAT
+	static constexpr uint8_t LINE_CLK = 0x02;
+	static constexpr uint8_t LINE_DAT = 0x01;
+	/// Where the lines go in a run word
+	static constexpr uint8_t LINES_SHIFT = 14;
+	/// The longest run one word can hold, in ticks
+	static constexpr uint16_t MAX_RUN = 0x3FFF;
+
+	LineCapture()
+	    : m_state( CaptureState::Off ),
+	      m_lines( 0 ),
+	      m_run_start( 0 ),
+	      m_count( 0 ),
+	      m_read( 0 )
+	{
+	}
+
+	/**
+	 * Throw away any old capture, and wait for the first edge.
+	 */
+	void arm()
+	{
+		m_count = 0;
+		m_read = 0;
+		m_state = CaptureState::Armed;
+	}
+
+	/**
+	 * Stop, throwing away anything not yet read.
+	 */
+	void stop() { m_state = CaptureState::Off; }
+
+	CaptureState state() const { return m_state; }
+
+	/**
+	 * Record the lines (`LINE_CLK | LINE_DAT`, for the ones that are high)
+	 * as they are at tick `now`.
+	 *
+	 * @return true if this sample finished the capture.
+	 */
+	bool sample( uint8_t lines, uint16_t now )
+	{
+		if ( m_state == CaptureState::Armed )
+		{
+			if ( lines == LINES_IDLE )
+			{
+				return false;
+			}
+			m_state = CaptureState::Capturing;
+			m_lines = lines;
+			m_run_start = now;
+			return false;
+		}
+		if ( m_state != CaptureState::Capturing )
+		{
+			return false;
+		}
+
+		uint16_t elapsed = now - m_run_start;
+		if ( lines != m_lines )
+		{
+			addRun( elapsed );
+			m_lines = lines;
+			m_run_start = now;
+		}
+		else if ( elapsed >= MAX_RUN )
+		{
+			if ( m_lines == LINES_IDLE )
+			{
+				// Gone quiet - end with one full-length idle run
+				addRun( MAX_RUN );
+				m_state = CaptureState::Done;
+			}
+			else
+			{
+				addRun( elapsed );
+				m_run_start = now;
+			}
+		}
+		return m_state == CaptureState::Done;
+	}
+
+	/**
+	 * Take up to `max` runs from a finished capture, oldest first.
+	 *
+	 * @return how many runs were copied to `out` - zero once they have all
+	 * been read.
+	 */
+	uint8_t read( uint16_t* out, uint8_t max )
+	{
+		if ( m_state != CaptureState::Done )
+		{
+			return 0;
+		}
+		uint8_t count = 0;
+		while ( ( count < max ) && ( m_read < m_count ) )
+		{
+			out[count++] = m_runs[m_read++];
+		}
+		return count;
+	}
+
+#ifndef TEST_MODE_NO_PRIVATE
+   private:
+#endif
+
+	/**
+	 * Record the current lines, held for `ticks`. Stops once full.
+	 */
+	void addRun( uint16_t ticks )
+	{
+		do
+		{
+			uint16_t run = ( ticks > MAX_RUN ) ? MAX_RUN : ticks;
+			m_runs[m_count++] = ( (uint16_t)m_lines << LINES_SHIFT ) | run;
+			ticks -= run;
+		} while ( ( ticks != 0 ) && ( m_count < N ) );
+		if ( m_count == N )
+		{
+			m_state = CaptureState::Done;
+		}
+	}
+
+	static constexpr uint8_t LINES_IDLE = LINE_CLK | LINE_DAT;
+
+	CaptureState m_state;
+	/// The levels in the current run
+	uint8_t m_lines;
+	/// When the current run started, in ticks
+	uint16_t m_run_start;
+	/// How many entries of `m_runs` are used
+	uint8_t m_count;
+	/// How many have been read out
+	uint8_t m_read;
+	uint16_t m_runs[N];
+};
@@ -0,0 +1,183 @@
+/**
+ * Neotron-IO host command parser.
+ *
+ * Host commands are a letter followed by one or more hex bytes and a
+ * newline, like `KED02`. The parser runs in the USART RX Complete interrupt,
+ * a character at a time, and builds each command in place in the next free
+ * slot of a `SpscRingBuf<HostCommand, N>`. The slot is only committed once
+ * the newline arrives, so `loop()` only ever sees whole commands and doesn't
+ * care how the characters were spread out in time.
+ *
+ * A bad hex digit, or too many bytes, drops the line. If the queue is full
+ * when a command starts, we skip to the end of the line and count it in
+ * `dropped`.
+ *
+ * This project is also licensed under the GPL (v3 or later version, at your
+ * choice). See the [LICENCE](./LICENCE) file.
+ */
+
+#include "RingBuf.h"
+#include "hex.h"
+
+/// The command letters the firmware accepts from the host
+static const char HOST_COMMANDS[] PROGMEM = "KMPCRWDQLE";
+
+/**
+ * One complete command from the host.
+ */
+struct HostCommand
+{
+	static constexpr uint8_t MAX_DATA = 16;
+
+	/// The command letter
+	char command;
+	/// How many bytes are in `data`
+	uint8_t length;
+	uint8_t data[MAX_DATA];
+};
+
+/**
+ * Turns characters from the host into `HostCommand`s.
+ */
+template <typename QUEUE>
+class CommandParser
+{
+   public:
+	/**
+	 * Construct a new CommandParser object.
+	 *
+	 * @param queue where finished commands go - we are its only producer
+	 * @param commands the command letters we accept, as a PROGMEM string
+	 */
+	CommandParser( QUEUE& queue, const char* commands )
+	    : m_queue( queue ),
+	      m_commands( commands ),
+	      m_state( State::WantCommand ),
+	      m_command( nullptr ),
+	      m_dropped( 0 )
+	{
+	}
+
+	/**
+	 * Take the next character from the host. Call this from the RX
+	 * interrupt (it has the same shape as a receive buffer's `push`, so it
+	 * can be given straight to `HostUart`).
+	 */
+	void push( char c )
+	{
+		switch ( m_state )
+		{
+			case State::WantCommand:
+				if ( ( c != '\0' ) && ( strchr_P( m_commands, c ) != NULL ) )
+				{
+					typename QUEUE::Span span = m_queue.contiguousWritable();
+					if ( span.length == 0 )
+					{
+						m_dropped++;
+						m_state = State::WantNewline;
+						break;
+					}
+					m_command = span.data;
+					m_command->command = c;
+					m_command->length = 0;
+					m_state = State::WantHiNibble;
+				}
+				break;
+			case State::WantHiNibbleOrNewline:
+				if ( ( c == '\r' ) || ( c == '\n' ) )
+				{
+					m_queue.commit( 1 );
+					m_state = State::WantCommand;
+					break;
+				}
+				// Otherwise it should be the start of another byte
+				// fall through
+			case State::WantHiNibble:
+			{
+				uint8_t nibble = hexDecode( c );
+				if ( ( nibble != HEX_INVALID ) &&
+				     ( m_command->length < HostCommand::MAX_DATA ) )
+				{
+					m_command->data[m_command->length] = nibble << 4;
+					m_state = State::WantLoNibble;
+				}
+				else
+				{
+					// Bad digit, or too long - drop the whole line
+					dropLine( c );
+				}
+				break;
+			}
+			case State::WantLoNibble:
+			{
+				uint8_t nibble = hexDecode( c );
+				if ( nibble != HEX_INVALID )
+				{
+					m_command->data[m_command->length++] |= nibble;
+					m_state = State::WantHiNibbleOrNewline;
+				}
+				else
+				{
+					dropLine( c );
+				}
+				break;
+			}
+			case State::WantNewline:
+				if ( ( c == '\r' ) || ( c == '\n' ) )
+				{
+					m_state = State::WantCommand;
+				}
+				break;
+		}
+	}
+
+	/**
+	 * How many commands were thrown away because the queue was full, since
+	 * `clearDropped` (wraps round at 0xFFFF).
+	 */
+	uint16_t dropped()
+	{
+		noInterrupts();
+		uint16_t result = m_dropped;
+		interrupts();
+		return result;
+	}
+
+	void clearDropped()
+	{
+		noInterrupts();
+		m_dropped = 0;
+		interrupts();
+	}
+
+#ifndef TEST_MODE_NO_PRIVATE
+   private:
+#endif
+
+	/**
+	 * Throw away the command we were building, and skip the rest of its
+	 * line - unless `c`, the character that spoilt it, ended the line.
+	 */
+	void dropLine( char c )
+	{
+		bool newline = ( c == '\r' ) || ( c == '\n' );
+		m_state = newline ? State::WantCommand : State::WantNewline;
+	}
+
+	enum class State : uint8_t
+	{
+		WantCommand,
+		WantHiNibble,
+		WantLoNibble,
+		WantHiNibbleOrNewline,
+		/// The queue was full, or the line was bad - ignore the rest of it
+		WantNewline,
+	};
+
+	QUEUE& m_queue;
+	const char* m_commands;
+	State m_state;
+	/// The queue slot we are filling in
+	HostCommand* m_command;
+	uint16_t m_dropped;
+};
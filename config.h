@@ -0,0 +1,210 @@
+/**
+ * Neotron-IO stored configuration.
+ *
+ * The settings we boot with live in one block in EEPROM: a version byte,
+ * the `Config` struct, then a CRC-8 of both. `setup()` reads the block into
+ * RAM once. If the version is wrong or the CRC doesn't match (like on a
+ * fresh chip), we use the defaults instead.
+ *
+ * The host reads and writes the settings a field at a time (see
+ * `ConfigField`). Each field is a run of bytes in `Config`, and is read and
+ * written in the same layout - so an init sequence is its length, then its
+ * bytes.
+ *
+ * This project is also licensed under the GPL (v3 or later version, at your
+ * choice). See the [LICENCE](./LICENCE) file.
+ */
+
+#include <stddef.h>
+#include <string.h>
+
+/// Bump this if the layout of `Config` changes, so old blocks are ignored
+static constexpr uint8_t CONFIG_VERSION = 1;
+
+/// The longest PS/2 init sequence we can store, per device
+static constexpr uint8_t CONFIG_MAX_INIT = 8;
+
+/**
+ * Everything we keep in EEPROM, apart from OSCCAL. Only `uint8_t`s, so
+ * there's no padding.
+ */
+struct Config
+{
+	/// Index into the `R` command's baud rates
+	uint8_t baud_index;
+	/// As for the `P` command
+	uint8_t protocol;
+	/// As for the `W` command
+	uint8_t batch_window_ms;
+	/// Joystick debounce, in samples
+	uint8_t joystick_debounce;
+	/// Bytes to send the keyboard at boot, as if from a `K` command
+	uint8_t keyboard_init_length;
+	uint8_t keyboard_init[CONFIG_MAX_INIT];
+	/// Bytes to send the mouse at boot, as if from an `M` command
+	uint8_t mouse_init_length;
+	uint8_t mouse_init[CONFIG_MAX_INIT];
+};
+
+/**
+ * The fields the host can read and write.
+ */
+enum class ConfigField : uint8_t
+{
+	BaudIndex = 0,
+	Protocol = 1,
+	BatchWindow = 2,
+	JoystickDebounce = 3,
+	KeyboardInit = 4,
+	MouseInit = 5,
+};
+
+/// Version, then the `Config`, then the CRC
+static constexpr size_t CONFIG_BLOCK_SIZE = 1 + sizeof( Config ) + 1;
+
+/**
+ * CRC-8 with polynomial 0x07, starting from zero.
+ */
+static uint8_t configCrc( const uint8_t* data, size_t data_len )
+{
+	uint8_t crc = 0;
+	for ( size_t i = 0; i < data_len; i++ )
+	{
+		crc ^= data[i];
+		for ( uint8_t bit = 0; bit < 8; bit++ )
+		{
+			crc = ( crc & 0x80 ) ? ( ( crc << 1 ) ^ 0x07 ) : ( crc << 1 );
+		}
+	}
+	return crc;
+}
+
+/**
+ * Lay out `config` as a block for EEPROM.
+ */
+static void configToBlock( const Config& config, uint8_t* block )
+{
+	block[0] = CONFIG_VERSION;
+	memcpy( &block[1], &config, sizeof( config ) );
+	block[CONFIG_BLOCK_SIZE - 1] = configCrc( block, CONFIG_BLOCK_SIZE - 1 );
+}
+
+/**
+ * Get a `Config` back out of a block from EEPROM.
+ *
+ * @return false (leaving `config` alone) if the block isn't one of ours.
+ */
+static bool configFromBlock( const uint8_t* block, Config& config )
+{
+	if ( ( block[0] != CONFIG_VERSION ) ||
+	     ( block[CONFIG_BLOCK_SIZE - 1] !=
+	       configCrc( block, CONFIG_BLOCK_SIZE - 1 ) ) )
+	{
+		return false;
+	}
+	memcpy( &config, &block[1], sizeof( config ) );
+	return true;
+}
+
+/**
+ * Where a field is in `Config`, and how big it can be.
+ *
+ * @return false if there's no such field.
+ */
+static bool configFieldSpan( uint8_t field, uint8_t& offset, uint8_t& size )
+{
+	switch ( (ConfigField)field )
+	{
+		case ConfigField::BaudIndex:
+			offset = offsetof( Config, baud_index );
+			size = 1;
+			return true;
+		case ConfigField::Protocol:
+			offset = offsetof( Config, protocol );
+			size = 1;
+			return true;
+		case ConfigField::BatchWindow:
+			offset = offsetof( Config, batch_window_ms );
+			size = 1;
+			return true;
+		case ConfigField::JoystickDebounce:
+			offset = offsetof( Config, joystick_debounce );
+			size = 1;
+			return true;
+		case ConfigField::KeyboardInit:
+			offset = offsetof( Config, keyboard_init_length );
+			size = 1 + CONFIG_MAX_INIT;
+			return true;
+		case ConfigField::MouseInit:
+			offset = offsetof( Config, mouse_init_length );
+			size = 1 + CONFIG_MAX_INIT;
+			return true;
+	}
+	return false;
+}
+
+/**
+ * Is `field` an init sequence (a length, then that many bytes)?
+ */
+static bool configFieldIsSequence( uint8_t field )
+{
+	return ( field == (uint8_t)ConfigField::KeyboardInit ) ||
+	       ( field == (uint8_t)ConfigField::MouseInit );
+}
+
+/**
+ * Copy a field out of `config`.
+ *
+ * @return how many bytes went into `out`, or -1 if there's no such field.
+ */
+static int8_t configGetField( const Config& config,
+                             uint8_t field,
+                             uint8_t* out )
+{
+	uint8_t offset;
+	uint8_t size;
+	if ( !configFieldSpan( field, offset, size ) )
+	{
+		return -1;
+	}
+	const uint8_t* p = reinterpret_cast<const uint8_t*>( &config ) + offset;
+	if ( configFieldIsSequence( field ) )
+	{
+		size = 1 + p[0];
+	}
+	memcpy( out, p, size );
+	return size;
+}
+
+/**
+ * Write a field of `config`, laid out as `configGetField` gives it.
+ *
+ * @return false (leaving `config` alone) if there's no such field, or the
+ * data is the wrong length for it.
+ */
+static bool configSetField( Config& config,
+                            uint8_t field,
+                            const uint8_t* data,
+                            uint8_t data_len )
+{
+	uint8_t offset;
+	uint8_t size;
+	if ( !configFieldSpan( field, offset, size ) || ( data_len == 0 ) )
+	{
+		return false;
+	}
+	if ( configFieldIsSequence( field ) )
+	{
+		if ( ( data[0] > CONFIG_MAX_INIT ) || ( data_len != 1 + data[0] ) )
+		{
+			return false;
+		}
+	}
+	else if ( data_len != size )
+	{
+		return false;
+	}
+	uint8_t* p = reinterpret_cast<uint8_t*>( &config ) + offset;
+	memcpy( p, data, data_len );
+	return true;
+}
@@ -0,0 +1,149 @@
+/**
+ * Neotron-IO hex codec for the host protocol.
+ *
+ * Two lookup tables in flash: one gives the two ASCII hex digits for every
+ * byte value, the other gives the nibble value for every character (or
+ * `HEX_INVALID` if it isn't a hex digit, either case). Encoding a byte or
+ * decoding a digit is then just a couple of loads, with no shifts or range
+ * checks.
+ *
+ * This project is also licensed under the GPL (v3 or later version, at your
+ * choice). See the [LICENCE](./LICENCE) file.
+ */
+
+#ifndef HEX_H
+#define HEX_H
+
+#include <Arduino.h>
+
+/// What `hexDecode` returns for a character that isn't a hex digit
+static constexpr uint8_t HEX_INVALID = 0xFF;
+
+/// The two upper-case hex digits for each byte value, most significant first
+static const char HEX_DIGITS[256][2] PROGMEM = {
+	{ '0', '0' }, { '0', '1' }, { '0', '2' }, { '0', '3' },  // 0x00
+	{ '0', '4' }, { '0', '5' }, { '0', '6' }, { '0', '7' },  // 0x04
+	{ '0', '8' }, { '0', '9' }, { '0', 'A' }, { '0', 'B' },  // 0x08
+	{ '0', 'C' }, { '0', 'D' }, { '0', 'E' }, { '0', 'F' },  // 0x0C
+	{ '1', '0' }, { '1', '1' }, { '1', '2' }, { '1', '3' },  // 0x10
+	{ '1', '4' }, { '1', '5' }, { '1', '6' }, { '1', '7' },  // 0x14
+	{ '1', '8' }, { '1', '9' }, { '1', 'A' }, { '1', 'B' },  // 0x18
+	{ '1', 'C' }, { '1', 'D' }, { '1', 'E' }, { '1', 'F' },  // 0x1C
+	{ '2', '0' }, { '2', '1' }, { '2', '2' }, { '2', '3' },  // 0x20
+	{ '2', '4' }, { '2', '5' }, { '2', '6' }, { '2', '7' },  // 0x24
+	{ '2', '8' }, { '2', '9' }, { '2', 'A' }, { '2', 'B' },  // 0x28
+	{ '2', 'C' }, { '2', 'D' }, { '2', 'E' }, { '2', 'F' },  // 0x2C
+	{ '3', '0' }, { '3', '1' }, { '3', '2' }, { '3', '3' },  // 0x30
+	{ '3', '4' }, { '3', '5' }, { '3', '6' }, { '3', '7' },  // 0x34
+	{ '3', '8' }, { '3', '9' }, { '3', 'A' }, { '3', 'B' },  // 0x38
+	{ '3', 'C' }, { '3', 'D' }, { '3', 'E' }, { '3', 'F' },  // 0x3C
+	{ '4', '0' }, { '4', '1' }, { '4', '2' }, { '4', '3' },  // 0x40
+	{ '4', '4' }, { '4', '5' }, { '4', '6' }, { '4', '7' },  // 0x44
+	{ '4', '8' }, { '4', '9' }, { '4', 'A' }, { '4', 'B' },  // 0x48
+	{ '4', 'C' }, { '4', 'D' }, { '4', 'E' }, { '4', 'F' },  // 0x4C
+	{ '5', '0' }, { '5', '1' }, { '5', '2' }, { '5', '3' },  // 0x50
+	{ '5', '4' }, { '5', '5' }, { '5', '6' }, { '5', '7' },  // 0x54
+	{ '5', '8' }, { '5', '9' }, { '5', 'A' }, { '5', 'B' },  // 0x58
+	{ '5', 'C' }, { '5', 'D' }, { '5', 'E' }, { '5', 'F' },  // 0x5C
+	{ '6', '0' }, { '6', '1' }, { '6', '2' }, { '6', '3' },  // 0x60
+	{ '6', '4' }, { '6', '5' }, { '6', '6' }, { '6', '7' },  // 0x64
+	{ '6', '8' }, { '6', '9' }, { '6', 'A' }, { '6', 'B' },  // 0x68
+	{ '6', 'C' }, { '6', 'D' }, { '6', 'E' }, { '6', 'F' },  // 0x6C
+	{ '7', '0' }, { '7', '1' }, { '7', '2' }, { '7', '3' },  // 0x70
+	{ '7', '4' }, { '7', '5' }, { '7', '6' }, { '7', '7' },  // 0x74
+	{ '7', '8' }, { '7', '9' }, { '7', 'A' }, { '7', 'B' },  // 0x78
+	{ '7', 'C' }, { '7', 'D' }, { '7', 'E' }, { '7', 'F' },  // 0x7C
+	{ '8', '0' }, { '8', '1' }, { '8', '2' }, { '8', '3' },  // 0x80
+	{ '8', '4' }, { '8', '5' }, { '8', '6' }, { '8', '7' },  // 0x84
+	{ '8', '8' }, { '8', '9' }, { '8', 'A' }, { '8', 'B' },  // 0x88
+	{ '8', 'C' }, { '8', 'D' }, { '8', 'E' }, { '8', 'F' },  // 0x8C
+	{ '9', '0' }, { '9', '1' }, { '9', '2' }, { '9', '3' },  // 0x90
+	{ '9', '4' }, { '9', '5' }, { '9', '6' }, { '9', '7' },  // 0x94
+	{ '9', '8' }, { '9', '9' }, { '9', 'A' }, { '9', 'B' },  // 0x98
+	{ '9', 'C' }, { '9', 'D' }, { '9', 'E' }, { '9', 'F' },  // 0x9C
+	{ 'A', '0' }, { 'A', '1' }, { 'A', '2' }, { 'A', '3' },  // 0xA0
+	{ 'A', '4' }, { 'A', '5' }, { 'A', '6' }, { 'A', '7' },  // 0xA4
+	{ 'A', '8' }, { 'A', '9' }, { 'A', 'A' }, { 'A', 'B' },  // 0xA8
+	{ 'A', 'C' }, { 'A', 'D' }, { 'A', 'E' }, { 'A', 'F' },  // 0xAC
+	{ 'B', '0' }, { 'B', '1' }, { 'B', '2' }, { 'B', '3' },  // 0xB0
+	{ 'B', '4' }, { 'B', '5' }, { 'B', '6' }, { 'B', '7' },  // 0xB4
+	{ 'B', '8' }, { 'B', '9' }, { 'B', 'A' }, { 'B', 'B' },  // 0xB8
+	{ 'B', 'C' }, { 'B', 'D' }, { 'B', 'E' }, { 'B', 'F' },  // 0xBC
+	{ 'C', '0' }, { 'C', '1' }, { 'C', '2' }, { 'C', '3' },  // 0xC0
+	{ 'C', '4' }, { 'C', '5' }, { 'C', '6' }, { 'C', '7' },  // 0xC4
+	{ 'C', '8' }, { 'C', '9' }, { 'C', 'A' }, { 'C', 'B' },  // 0xC8
+	{ 'C', 'C' }, { 'C', 'D' }, { 'C', 'E' }, { 'C', 'F' },  // 0xCC
+	{ 'D', '0' }, { 'D', '1' }, { 'D', '2' }, { 'D', '3' },  // 0xD0
+	{ 'D', '4' }, { 'D', '5' }, { 'D', '6' }, { 'D', '7' },  // 0xD4
+	{ 'D', '8' }, { 'D', '9' }, { 'D', 'A' }, { 'D', 'B' },  // 0xD8
+	{ 'D', 'C' }, { 'D', 'D' }, { 'D', 'E' }, { 'D', 'F' },  // 0xDC
+	{ 'E', '0' }, { 'E', '1' }, { 'E', '2' }, { 'E', '3' },  // 0xE0
+	{ 'E', '4' }, { 'E', '5' }, { 'E', '6' }, { 'E', '7' },  // 0xE4
+	{ 'E', '8' }, { 'E', '9' }, { 'E', 'A' }, { 'E', 'B' },  // 0xE8
+	{ 'E', 'C' }, { 'E', 'D' }, { 'E', 'E' }, { 'E', 'F' },  // 0xEC
+	{ 'F', '0' }, { 'F', '1' }, { 'F', '2' }, { 'F', '3' },  // 0xF0
+	{ 'F', '4' }, { 'F', '5' }, { 'F', '6' }, { 'F', '7' },  // 0xF4
+	{ 'F', '8' }, { 'F', '9' }, { 'F', 'A' }, { 'F', 'B' },  // 0xF8
+	{ 'F', 'C' }, { 'F', 'D' }, { 'F', 'E' }, { 'F', 'F' },  // 0xFC
+};
+
+#define XX HEX_INVALID
+
+/// The value of each hex digit character
+static const uint8_t HEX_NIBBLES[256] PROGMEM = {
+	XX,  XX,  XX,  XX,  XX,  XX,  XX,  XX,  // 0x00
+	XX,  XX,  XX,  XX,  XX,  XX,  XX,  XX,  // 0x08
+	XX,  XX,  XX,  XX,  XX,  XX,  XX,  XX,  // 0x10
+	XX,  XX,  XX,  XX,  XX,  XX,  XX,  XX,  // 0x18
+	XX,  XX,  XX,  XX,  XX,  XX,  XX,  XX,  // 0x20
+	XX,  XX,  XX,  XX,  XX,  XX,  XX,  XX,  // 0x28
+	0x0, 0x1, 0x2, 0x3, 0x4, 0x5, 0x6, 0x7,  // 0x30
+	0x8, 0x9, XX,  XX,  XX,  XX,  XX,  XX,  // 0x38
+	XX,  0xA, 0xB, 0xC, 0xD, 0xE, 0xF, XX,  // 0x40
+	XX,  XX,  XX,  XX,  XX,  XX,  XX,  XX,  // 0x48
+	XX,  XX,  XX,  XX,  XX,  XX,  XX,  XX,  // 0x50
+	XX,  XX,  XX,  XX,  XX,  XX,  XX,  XX,  // 0x58
+	XX,  0xA, 0xB, 0xC, 0xD, 0xE, 0xF, XX,  // 0x60
+	XX,  XX,  XX,  XX,  XX,  XX,  XX,  XX,  // 0x68
+	XX,  XX,  XX,  XX,  XX,  XX,  XX,  XX,  // 0x70
+	XX,  XX,  XX,  XX,  XX,  XX,  XX,  XX,  // 0x78
+	XX,  XX,  XX,  XX,  XX,  XX,  XX,  XX,  // 0x80
+	XX,  XX,  XX,  XX,  XX,  XX,  XX,  XX,  // 0x88
+	XX,  XX,  XX,  XX,  XX,  XX,  XX,  XX,  // 0x90
+	XX,  XX,  XX,  XX,  XX,  XX,  XX,  XX,  // 0x98
+	XX,  XX,  XX,  XX,  XX,  XX,  XX,  XX,  // 0xA0
+	XX,  XX,  XX,  XX,  XX,  XX,  XX,  XX,  // 0xA8
+	XX,  XX,  XX,  XX,  XX,  XX,  XX,  XX,  // 0xB0
+	XX,  XX,  XX,  XX,  XX,  XX,  XX,  XX,  // 0xB8
+	XX,  XX,  XX,  XX,  XX,  XX,  XX,  XX,  // 0xC0
+	XX,  XX,  XX,  XX,  XX,  XX,  XX,  XX,  // 0xC8
+	XX,  XX,  XX,  XX,  XX,  XX,  XX,  XX,  // 0xD0
+	XX,  XX,  XX,  XX,  XX,  XX,  XX,  XX,  // 0xD8
+	XX,  XX,  XX,  XX,  XX,  XX,  XX,  XX,  // 0xE0
+	XX,  XX,  XX,  XX,  XX,  XX,  XX,  XX,  // 0xE8
+	XX,  XX,  XX,  XX,  XX,  XX,  XX,  XX,  // 0xF0
+	XX,  XX,  XX,  XX,  XX,  XX,  XX,  XX,  // 0xF8
+};
+
+#undef XX
+
+/**
+ * Write a byte as two hex digits.
+ */
+static inline void hexEncode( uint8_t value, char* out )
+{
+	out[0] = pgm_read_byte( &HEX_DIGITS[value][0] );
+	out[1] = pgm_read_byte( &HEX_DIGITS[value][1] );
+}
+
+/**
+ * Get the value of a hex digit.
+ *
+ * @return 0x0 to 0xF, or `HEX_INVALID`
+ */
+static inline uint8_t hexDecode( char c )
+{
+	return pgm_read_byte( &HEX_NIBBLES[(uint8_t)c] );
+}
+
+#endif  // HEX_H
@@ -7,15 +7,29 @@
  *
  * The latter are distinguished by presenting both left and right active
  * together (which is impossible normally). This tells us to flip the SELECT
- * line and read again to get the other set of buttons. Note that six fire
- * button Sega Mega Drive / Genesis pads are not supported, and will be read
- * like three button pads.
+ * line and read again to get the other set of buttons.
+ *
+ * Six fire button Sega Mega Drive / Genesis pads count the SELECT pulses. On
+ * the third low they drive all four directions low, and on the third high
+ * they give X, Y, Z and Mode on the direction pins. The pad only goes back to
+ * the start of its count once SELECT has been left alone for about 1.5ms. So
+ * we step through the pulses one per call to `scan`, with a minimum settling
+ * time for each, rather than waiting in a delay loop.
+ *
+ * Each complete reading can be passed through a debounce filter. Every button
+ * has an integrator that counts up while the button reads pressed and down
+ * while it reads released. The reported state only changes when a count
+ * reaches the top or the bottom, so a contact that bounces for a few samples
+ * doesn't produce a burst of reports. The filter works in samples, so call
+ * `scan` at a steady rate (the sketch does it from a 1 kHz timer tick).
  *
  * This project is also licensed under the GPL (v3 or later version, at your
  * choice). See the [LICENCE](./LICENCE) file.
  */
 
 #include "DigitalPin.h"
+#include "port.h"
+#include "ticks.h"
 
 /**
  * Represents a reading from a Joystick port.
@@ -51,6 +65,14 @@ class JoystickResult
 
 	void set_start_pressed() { data |= ( 1 << SHIFT_START ); }
 
+	void set_x_pressed() { data |= ( 1 << SHIFT_X ); }
+
+	void set_y_pressed() { data |= ( 1 << SHIFT_Y ); }
+
+	void set_z_pressed() { data |= ( 1 << SHIFT_Z ); }
+
+	void set_mode_pressed() { data |= ( 1 << SHIFT_MODE ); }
+
 	bool is_fire_pressed() const { return ( data & ( 1 << SHIFT_A ) ) != 0; }
 
 	bool is_a_pressed() const { return ( data & ( 1 << SHIFT_A ) ) != 0; }
@@ -75,6 +97,17 @@ class JoystickResult
 		return ( data & ( 1 << SHIFT_START ) ) != 0;
 	}
 
+	bool is_x_pressed() const { return ( data & ( 1 << SHIFT_X ) ) != 0; }
+
+	bool is_y_pressed() const { return ( data & ( 1 << SHIFT_Y ) ) != 0; }
+
+	bool is_z_pressed() const { return ( data & ( 1 << SHIFT_Z ) ) != 0; }
+
+	bool is_mode_pressed() const
+	{
+		return ( data & ( 1 << SHIFT_MODE ) ) != 0;
+	}
+
 	bool is_left_right_pressed() const
 	{
 		return is_left_pressed() && is_right_pressed();
@@ -101,6 +134,9 @@ class JoystickResult
 #ifndef TEST_MODE_NO_PRIVATE
    private:
 #endif
+	template <int, int, int, int, int, int, int>
+	friend class Joystick;
+
 	uint16_t data;
 
 	static constexpr uint8_t SHIFT_UP = 0;
@@ -111,25 +147,39 @@ class JoystickResult
 	static constexpr uint8_t SHIFT_B = 5;
 	static constexpr uint8_t SHIFT_C = 6;
 	static constexpr uint8_t SHIFT_START = 7;
+	static constexpr uint8_t SHIFT_X = 8;
+	static constexpr uint8_t SHIFT_Y = 9;
+	static constexpr uint8_t SHIFT_Z = 10;
+	static constexpr uint8_t SHIFT_MODE = 11;
 	static constexpr uint8_t MASK_LEFT_RIGHT =
 	    ( 1 << SHIFT_LEFT ) | ( 1 << SHIFT_RIGHT );
 };
 
 /**
  * Represents a Joystick port that you can read.
+ *
+ * All the pins are sampled with one read of each port register, rather than
+ * one read per pin.
  */
-template <int PIN_START_C,
-          int PIN_A_B,
+template <int PIN_UP,
           int PIN_DOWN,
-          int PIN_UP,
-          int PIN_RIGHT,
           int PIN_LEFT,
+          int PIN_RIGHT,
+          int PIN_A_B,
+          int PIN_START_C,
           int PIN_SELECT>
 class Joystick
 {
    public:
-	Joystick() : m_pinmap_old( 0 ), m_pinmap( 0 )
+	Joystick()
+	    : m_pinmap( 0 ),
+	      m_pinmap_old( 0 ),
+	      m_pending( 0 ),
+	      m_step( SegaStep::Idle ),
+	      m_step_time( 0 ),
+	      m_six_button( false )
 	{
+		setDebounce( 0 );
 		pinMode( PIN_UP, INPUT_PULLUP );
 		pinMode( PIN_DOWN, INPUT_PULLUP );
 		pinMode( PIN_LEFT, INPUT_PULLUP );
@@ -151,6 +201,28 @@ class Joystick
 	/// false
 	bool has_new() const { return ( m_pinmap != m_pinmap_old ); }
 
+	/// Set how many samples in a row a button has to read the same before we
+	/// believe it has changed. 0 or 1 turns debouncing off.
+	void setDebounce( uint8_t samples )
+	{
+		m_debounce = samples;
+		// Start every integrator at the end matching what we report now
+		for ( uint8_t i = 0; i < NUM_BUTTONS; i++ )
+		{
+			bool pressed = ( m_pinmap.data & ( 1 << i ) ) != 0;
+			m_integrator[i] = pressed ? samples : 0;
+		}
+		m_unsettled = 0;
+	}
+
+	/// @return true if we're part way through reading a MegaDrive pad, and
+	/// `scan` should be called again soon (without waiting for the next
+	/// sample tick).
+	bool isSequencing() const
+	{
+		return ( m_step != SegaStep::Idle ) && ( m_step != SegaStep::Resetting );
+	}
+
 	///
 	/// Scans the joystick pins and calculates the new value.
 	///
@@ -161,67 +233,193 @@ class Joystick
 	///
 	bool scan()
 	{
-		JoystickResult new_pinmap;
-		// Pins are active low
-		if ( fastDigitalRead( PIN_UP ) == 0 )
+		uint16_t now = ticksNow();
+		uint16_t elapsed = now - m_step_time;
+		if ( m_step == SegaStep::Resetting )
 		{
-			new_pinmap.set_up_pressed();
-		};
-		if ( fastDigitalRead( PIN_DOWN ) == 0 )
+			if ( elapsed < SEGA_RESET )
+			{
+				// Still letting the pad forget the last sequence
+				return has_new();
+			}
+			m_step = SegaStep::Idle;
+		}
+		if ( m_step == SegaStep::Idle )
 		{
-			new_pinmap.set_down_pressed();
-		};
-		if ( fastDigitalRead( PIN_A_B ) == 0 )
+			// Pins are active low
+			PortSnapshot ports = readPorts();
+			JoystickResult new_pinmap(
+			    ( ports.isLow<PIN_UP>() << JoystickResult::SHIFT_UP ) |
+			    ( ports.isLow<PIN_DOWN>() << JoystickResult::SHIFT_DOWN ) |
+			    ( ports.isLow<PIN_LEFT>() << JoystickResult::SHIFT_LEFT ) |
+			    ( ports.isLow<PIN_RIGHT>() << JoystickResult::SHIFT_RIGHT ) |
+			    ( ports.isLow<PIN_A_B>() << JoystickResult::SHIFT_A ) |
+			    ( ports.isLow<PIN_START_C>() << JoystickResult::SHIFT_START ) );
+			if ( !new_pinmap.is_left_right_pressed() )
+			{
+				// Plain Atari / Master System stick - that's everything
+				accept( new_pinmap );
+				return has_new();
+			}
+			// Impossible for left and right to be active at the same time, so
+			// we must have a SEGA MegaDrive pad. Clear the left/right pins as
+			// they aren't actually set, and go and get the rest.
+			new_pinmap.clear_left_right_pressed();
+			m_pending = new_pinmap;
+			m_six_button = false;
+			nextStep( SegaStep::FirstHigh, true, now );
+			return has_new();
+		}
+
+		if ( elapsed < SEGA_SETTLE )
 		{
-			new_pinmap.set_a_pressed();
-		};
-		if ( fastDigitalRead( PIN_START_C ) == 0 )
+			return has_new();
+		}
+		if ( elapsed > SEGA_ABANDON )
 		{
-			new_pinmap.set_start_pressed();
-		};
-		if ( fastDigitalRead( PIN_LEFT ) == 0 )
+			// We were away too long and the pad may have reset its count part
+			// way through. Throw this one away and start again.
+			nextStep( SegaStep::Resetting, false, now );
+			return has_new();
+		}
+
+		PortSnapshot ports = readPorts();
+		switch ( m_step )
 		{
-			new_pinmap.set_left_pressed();
-		};
-		if ( fastDigitalRead( PIN_RIGHT ) == 0 )
+			case SegaStep::Idle:
+			case SegaStep::Resetting:
+				break;
+			case SegaStep::FirstHigh:
+				// Read the alternative pins
+				m_pending.data |=
+				    ( ports.isLow<PIN_UP>() << JoystickResult::SHIFT_UP ) |
+				    ( ports.isLow<PIN_DOWN>() << JoystickResult::SHIFT_DOWN ) |
+				    ( ports.isLow<PIN_LEFT>() << JoystickResult::SHIFT_LEFT ) |
+				    ( ports.isLow<PIN_RIGHT>() << JoystickResult::SHIFT_RIGHT ) |
+				    ( ports.isLow<PIN_A_B>() << JoystickResult::SHIFT_B ) |
+				    ( ports.isLow<PIN_START_C>() << JoystickResult::SHIFT_C );
+				nextStep( SegaStep::SecondLow, false, now );
+				break;
+			case SegaStep::SecondLow:
+				nextStep( SegaStep::SecondHigh, true, now );
+				break;
+			case SegaStep::SecondHigh:
+				nextStep( SegaStep::ThirdLow, false, now );
+				break;
+			case SegaStep::ThirdLow:
+				// Six button pads pull all the directions low here
+				m_six_button = ports.isLow<PIN_UP>() && ports.isLow<PIN_DOWN>() &&
+				               ports.isLow<PIN_LEFT>() &&
+				               ports.isLow<PIN_RIGHT>();
+				nextStep( SegaStep::ThirdHigh, true, now );
+				break;
+			case SegaStep::ThirdHigh:
+				if ( m_six_button )
+				{
+					m_pending.data |=
+					    ( ports.isLow<PIN_UP>() << JoystickResult::SHIFT_Z ) |
+					    ( ports.isLow<PIN_DOWN>() << JoystickResult::SHIFT_Y ) |
+					    ( ports.isLow<PIN_LEFT>() << JoystickResult::SHIFT_X ) |
+					    ( ports.isLow<PIN_RIGHT>() << JoystickResult::SHIFT_MODE );
+				}
+				// All done. Turn select off again, and leave the pad alone
+				// long enough for it to reset its count.
+				accept( m_pending );
+				nextStep( SegaStep::Resetting, false, now );
+				break;
+		}
+		return has_new();
+	}
+
+#ifndef TEST_MODE_NO_PRIVATE
+   private:
+#endif
+
+	/// Where we are in the MegaDrive SELECT sequence. Each step is named
+	/// after the SELECT level we set on the way in.
+	enum class SegaStep : uint8_t
+	{
+		Idle,
+		FirstHigh,
+		SecondLow,
+		SecondHigh,
+		ThirdLow,
+		ThirdHigh,
+		Resetting,
+	};
+
+	/// Run a complete reading through the debounce filter.
+	void accept( JoystickResult sample )
+	{
+		if ( m_debounce <= 1 )
 		{
-			new_pinmap.set_right_pressed();
-		};
-		if ( new_pinmap.is_left_right_pressed() )
+			m_pinmap = sample;
+			return;
+		}
+		// Only visit buttons that differ from what we report, or that are
+		// still part way between the two ends.
+		uint16_t busy = ( sample.data ^ m_pinmap.data ) | m_unsettled;
+		for ( uint8_t i = 0; busy != 0; i++, busy >>= 1 )
 		{
-			// Impossible for left and right to be active at the same time, so
-			// we must have a SEGA MegaDrive pad.
-			fastDigitalWrite( PIN_SELECT, 1 );
-			// Clear the left/right pins as they aren't actually set
-			new_pinmap.clear_left_right_pressed();
-			// Read the alternative pins
-			if ( fastDigitalRead( PIN_LEFT ) == 0 )
+			if ( !( busy & 1 ) )
+			{
+				continue;
+			}
+			uint16_t mask = 1 << i;
+			uint8_t& count = m_integrator[i];
+			if ( sample.data & mask )
+			{
+				if ( count < m_debounce )
+				{
+					count++;
+				}
+			}
+			else if ( count > 0 )
 			{
-				new_pinmap.set_left_pressed();
+				count--;
 			}
-			if ( fastDigitalRead( PIN_RIGHT ) == 0 )
+			if ( count == m_debounce )
 			{
-				new_pinmap.set_right_pressed();
+				m_pinmap.data |= mask;
+				m_unsettled &= ~mask;
 			}
-			if ( fastDigitalRead( PIN_A_B ) == 0 )
+			else if ( count == 0 )
 			{
-				new_pinmap.set_b_pressed();
+				m_pinmap.data &= ~mask;
+				m_unsettled &= ~mask;
 			}
-			if ( fastDigitalRead( PIN_START_C ) == 0 )
+			else
 			{
-				new_pinmap.set_c_pressed();
+				m_unsettled |= mask;
 			}
-			// Turn select off again
-			fastDigitalWrite( PIN_SELECT, 0 );
 		}
-		m_pinmap = new_pinmap;
-		return has_new();
 	}
 
-#ifndef TEST_MODE_NO_PRIVATE
-   private:
-#endif
+	void nextStep( SegaStep step, bool select, uint16_t now )
+	{
+		fastDigitalWrite( PIN_SELECT, select );
+		m_step = step;
+		m_step_time = now;
+	}
+
+	/// How long the pad needs after a SELECT change, before we read it
+	static constexpr uint16_t SEGA_SETTLE = ticksFromMicros<10>();
+	/// A six button pad resets its count after ~1.5ms - stay well inside it
+	static constexpr uint16_t SEGA_ABANDON = ticksFromMicros<1000>();
+	/// How long to leave SELECT low before starting another sequence, in the
+	/// Resetting step
+	static constexpr uint16_t SEGA_RESET = ticksFromMicros<2000>();
+	/// Up, down, left, right, A, B, C, Start, X, Y, Z and Mode
+	static constexpr uint8_t NUM_BUTTONS = 12;
 
 	JoystickResult m_pinmap;
 	JoystickResult m_pinmap_old;
+	JoystickResult m_pending;
+	SegaStep m_step;
+	uint16_t m_step_time;
+	bool m_six_button;
+	uint8_t m_debounce;
+	/// Buttons whose integrator is somewhere between the two ends
+	uint16_t m_unsettled;
+	uint8_t m_integrator[NUM_BUTTONS];
 };
@@ -0,0 +1,197 @@
+/**
+ * Neotron-IO PS/2 keyboard scan-code decoder.
+ *
+ * Turns the raw Scan Code Set 2 byte stream into one event per key press or
+ * release. `E0` prefixed keys are numbered with the top bit set (so Right
+ * Ctrl, `E0 14`, is key 0x94). Only F7 (`83`) has the top bit set without a
+ * prefix, and `E0 03` doesn't exist, so there's no overlap. Pause (`E1 14 77
+ * E1 F0 14 F0 77`) is key 0xF7, and as it has no break code we report a press
+ * and a release together.
+ *
+ * We keep a bitmap of which keys are down. Typematic repeats (more makes for
+ * a key that is already down) are dropped, as are the 'fake shift' codes
+ * (`E0 12` and `E0 59`) that some keys wrap themselves in.
+ *
+ * Bytes that aren't scan codes (ACK, BAT results, Echo, etc) aren't decoded
+ * and should go to the host as they are. A BAT result or a buffer overrun
+ * means the keyboard has reset or lost bytes, so we can't trust the bitmap -
+ * the caller releases every key still marked as down with `takeHeldKey`.
+ *
+ * This project is also licensed under the GPL (v3 or later version, at your
+ * choice). See the [LICENCE](./LICENCE) file.
+ */
+
+#include <string.h>
+
+enum class KeyboardDecodeResult
+{
+	/// Byte was used, but nothing to report yet
+	Nothing,
+	/// Byte wasn't a scan code - pass it on as it is
+	Raw,
+	/// A key went down
+	Pressed,
+	/// A key came up
+	Released,
+	/// Pause - a press and a release at the same time
+	PressedAndReleased,
+	/// The keyboard reset, or lost bytes - release each key `takeHeldKey`
+	/// gives, then pass the byte on as it is
+	Reset,
+};
+
+/**
+ * Decodes Scan Code Set 2 into key presses and releases.
+ */
+class KeyboardDecoder
+{
+   public:
+	KeyboardDecoder() { reset(); }
+
+	/**
+	 * Forget all keys and any part-received sequence.
+	 */
+	void reset()
+	{
+		memset( m_pressed, 0, sizeof( m_pressed ) );
+		m_extended = false;
+		m_release = false;
+		m_pause_remaining = 0;
+	}
+
+	/**
+	 * Is the given key down?
+	 */
+	bool isPressed( uint8_t key ) const
+	{
+		return ( m_pressed[key >> 3] & ( 1 << ( key & 7 ) ) ) != 0;
+	}
+
+	/**
+	 * Give the decoder a byte from the keyboard.
+	 *
+	 * @param b the byte from the keyboard
+	 * @param key set to the key number if a key event is returned
+	 */
+	KeyboardDecodeResult feed( uint8_t b, uint8_t& key )
+	{
+		if ( m_pause_remaining != 0 )
+		{
+			m_pause_remaining--;
+			if ( m_pause_remaining == 0 )
+			{
+				key = KEY_PAUSE;
+				return KeyboardDecodeResult::PressedAndReleased;
+			}
+			return KeyboardDecodeResult::Nothing;
+		}
+
+		switch ( b )
+		{
+			case PREFIX_EXTENDED:
+				m_extended = true;
+				return KeyboardDecodeResult::Nothing;
+			case PREFIX_RELEASE:
+				m_release = true;
+				return KeyboardDecodeResult::Nothing;
+			case PREFIX_PAUSE:
+				m_pause_remaining = PAUSE_SEQUENCE_LEN - 1;
+				return KeyboardDecodeResult::Nothing;
+			default:
+				break;
+		}
+
+		if ( ( b > LAST_SCAN_CODE ) || ( b == OVERRUN ) )
+		{
+			// ACK, BAT, Echo, Resend or a buffer overrun - not a key
+			m_extended = false;
+			m_release = false;
+			if ( ( b == BAT_PASSED ) || ( b == BAT_FAILED ) ||
+			     ( b == OVERRUN ) || ( b == OVERRUN_SET_1 ) )
+			{
+				return KeyboardDecodeResult::Reset;
+			}
+			return KeyboardDecodeResult::Raw;
+		}
+
+		bool extended = m_extended;
+		bool release = m_release;
+		m_extended = false;
+		m_release = false;
+
+		if ( extended &&
+		     ( ( b == FAKE_SHIFT_LEFT ) || ( b == FAKE_SHIFT_RIGHT ) ) )
+		{
+			return KeyboardDecodeResult::Nothing;
+		}
+
+		key = extended ? ( b | EXTENDED_FLAG ) : b;
+		uint8_t mask = 1 << ( key & 7 );
+		uint8_t& slot = m_pressed[key >> 3];
+		if ( release )
+		{
+			// Always report a release, in case the key was already down when
+			// we started decoding.
+			slot &= ~mask;
+			return KeyboardDecodeResult::Released;
+		}
+		if ( slot & mask )
+		{
+			// Typematic repeat
+			return KeyboardDecodeResult::Nothing;
+		}
+		slot |= mask;
+		return KeyboardDecodeResult::Pressed;
+	}
+
+	/**
+	 * Take a key that is marked as down off the bitmap, after a `Reset`.
+	 *
+	 * @return false once no key is marked as down.
+	 */
+	bool takeHeldKey( uint8_t& key )
+	{
+		for ( uint8_t i = 0; i < sizeof( m_pressed ); i++ )
+		{
+			uint8_t slot = m_pressed[i];
+			if ( slot == 0 )
+			{
+				continue;
+			}
+			uint8_t bit = 0;
+			while ( ( slot & ( 1 << bit ) ) == 0 )
+			{
+				bit++;
+			}
+			m_pressed[i] = slot & ~( 1 << bit );
+			key = ( i << 3 ) | bit;
+			return true;
+		}
+		return false;
+	}
+
+#ifndef TEST_MODE_NO_PRIVATE
+   private:
+#endif
+
+	static constexpr uint8_t PREFIX_EXTENDED = 0xE0;
+	static constexpr uint8_t PREFIX_PAUSE = 0xE1;
+	static constexpr uint8_t PREFIX_RELEASE = 0xF0;
+	static constexpr uint8_t LAST_SCAN_CODE = 0x83;
+	static constexpr uint8_t FAKE_SHIFT_LEFT = 0x12;
+	static constexpr uint8_t FAKE_SHIFT_RIGHT = 0x59;
+	static constexpr uint8_t EXTENDED_FLAG = 0x80;
+	static constexpr uint8_t KEY_PAUSE = 0xF7;
+	static constexpr uint8_t PAUSE_SEQUENCE_LEN = 8;
+	static constexpr uint8_t BAT_PASSED = 0xAA;
+	static constexpr uint8_t BAT_FAILED = 0xFC;
+	/// Buffer overrun, in Scan Code Set 2 and in Set 1
+	static constexpr uint8_t OVERRUN = 0x00;
+	static constexpr uint8_t OVERRUN_SET_1 = 0xFF;
+
+	/// One bit per key - 256 bits
+	uint8_t m_pressed[32];
+	bool m_extended;
+	bool m_release;
+	uint8_t m_pause_remaining;
+};
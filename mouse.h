@@ -0,0 +1,340 @@
+/**
+ * Neotron-IO PS/2 mouse packet assembler.
+ *
+ * Sits between the mouse's `Ps2` port and the host. It watches the bytes the
+ * host sends to the mouse, so it knows when the mouse is streaming movement
+ * packets (after an `F4` Enable Data Reporting command is ACKed), and whether
+ * those packets are 3 bytes (standard) or 4 bytes (IntelliMouse, after the
+ * mouse reports ID 3 or 4 to a `F2` Get Device ID command). The host can send
+ * several bytes at once, and the mouse ACKs each one in turn, so we step
+ * through them as the responses come back.
+ *
+ * While streaming, packets are only handed on when the host link has room
+ * for them. Until then, movement is added up, so the next packet out carries
+ * all of it and nothing is lost. Packets are only merged if the buttons are
+ * the same, so clicks aren't lost either.
+ *
+ * Anything that isn't a movement packet (command responses, etc) goes
+ * straight through.
+ *
+ * This project is also licensed under the GPL (v3 or later version, at your
+ * choice). See the [LICENCE](./LICENCE) file.
+ */
+
+#include <string.h>
+
+/**
+ * One movement report, possibly made from several added together.
+ */
+struct MousePacket
+{
+	uint8_t buttons;
+	int16_t dx;
+	int16_t dy;
+	int16_t wheel;
+};
+
+/**
+ * Finds movement packets in the mouse's byte stream, and merges them when
+ * the host can't keep up.
+ */
+class MouseAssembler
+{
+   public:
+	MouseAssembler()
+	    : m_streaming( false ),
+	      m_expect( Expect::Nothing ),
+	      m_device_id( 0 ),
+	      m_index( 0 ),
+	      m_command_len( 0 ),
+	      m_command_index( 0 ),
+	      m_queue_len( 0 )
+	{
+	}
+
+	/**
+	 * Tell the assembler about a byte the host is sending to the mouse.
+	 */
+	void onHostByte( uint8_t b ) { onHostBytes( &b, 1 ); }
+
+	/**
+	 * Tell the assembler about bytes the host is sending to the mouse, all
+	 * at once. Any bytes after the first `MAX_COMMAND_LEN` aren't tracked.
+	 */
+	void onHostBytes( const uint8_t* data, uint8_t data_len )
+	{
+		// Any command stops us treating the stream as packets, until the
+		// mouse ACKs an Enable Data Reporting command.
+		m_streaming = false;
+		m_index = 0;
+		if ( data_len > MAX_COMMAND_LEN )
+		{
+			data_len = MAX_COMMAND_LEN;
+		}
+		memcpy( m_commands, data, data_len );
+		m_command_len = data_len;
+		m_command_index = 0;
+		m_expect = ( data_len != 0 ) ? Expect::Ack : Expect::Nothing;
+	}
+
+	/**
+	 * Give the assembler a byte from the mouse.
+	 *
+	 * @return true if the byte isn't part of a movement packet, and should go
+	 * to the host as it is.
+	 */
+	bool feed( uint8_t b )
+	{
+		if ( !m_streaming )
+		{
+			handleResponse( b );
+			return true;
+		}
+		if ( ( m_index == 0 ) && ( b == BAT_COMPLETE ) )
+		{
+			// Mouse has been reset (e.g. hot-plugged) behind our back
+			m_streaming = false;
+			m_device_id = 0;
+			return true;
+		}
+		if ( ( m_index == 0 ) && !( b & STATUS_ALWAYS_ONE ) )
+		{
+			// Out of sync - wait for something that looks like a status byte
+			return false;
+		}
+		m_packet[m_index++] = b;
+		if ( m_index == packetSize() )
+		{
+			m_index = 0;
+			queuePacket( decode() );
+		}
+		return false;
+	}
+
+	/**
+	 * Are there packets waiting to go to the host?
+	 */
+	bool hasPacket() const { return m_queue_len != 0; }
+
+	/**
+	 * Get the oldest waiting packet, as PS/2 bytes. Only call this when the
+	 * host link has room for it. If it holds more movement than fits in one
+	 * PS/2 packet, the rest stays queued.
+	 *
+	 * @param out somewhere to put up to 4 bytes
+	 * @return the number of bytes written to `out`, or zero.
+	 */
+	uint8_t takePacket( uint8_t* out )
+	{
+		if ( m_queue_len == 0 )
+		{
+			return 0;
+		}
+		MousePacket& p = m_queue[0];
+		int16_t dx = clamp( p.dx, -256, 255 );
+		int16_t dy = clamp( p.dy, -256, 255 );
+		int16_t wheel = ( m_device_id == 4 ) ? clamp( p.wheel, -8, 7 )
+		                                     : clamp( p.wheel, -128, 127 );
+		p.dx -= dx;
+		p.dy -= dy;
+		p.wheel -= wheel;
+
+		out[0] = STATUS_ALWAYS_ONE | ( p.buttons & BUTTONS_MASK );
+		if ( dx < 0 )
+		{
+			out[0] |= STATUS_X_SIGN;
+		}
+		if ( dy < 0 )
+		{
+			out[0] |= STATUS_Y_SIGN;
+		}
+		out[1] = (uint8_t)dx;
+		out[2] = (uint8_t)dy;
+		uint8_t len = 3;
+		if ( packetSize() == 4 )
+		{
+			if ( m_device_id == 4 )
+			{
+				// 5-button mice keep buttons 4 and 5 in the top nibble
+				out[3] = ( wheel & 0x0F ) | ( p.buttons & EXTRA_BUTTONS_MASK );
+			}
+			else
+			{
+				out[3] = (uint8_t)wheel;
+			}
+			len = 4;
+		}
+
+		if ( ( p.dx == 0 ) && ( p.dy == 0 ) && ( p.wheel == 0 ) )
+		{
+			// All sent - move the queue up
+			m_queue_len--;
+			for ( uint8_t i = 0; i < m_queue_len; i++ )
+			{
+				m_queue[i] = m_queue[i + 1];
+			}
+		}
+		return len;
+	}
+
+#ifndef TEST_MODE_NO_PRIVATE
+   private:
+#endif
+
+	enum class Expect : uint8_t
+	{
+		Nothing,
+		/// The ACK for `m_commands[m_command_index]`
+		Ack,
+		/// The ID that follows the ACK for a Get Device ID command
+		Id
+	};
+
+	void handleResponse( uint8_t b )
+	{
+		switch ( m_expect )
+		{
+			case Expect::Nothing:
+				break;
+			case Expect::Ack:
+			{
+				if ( b != RESPONSE_ACK )
+				{
+					// Error or resend - stop following along
+					m_expect = Expect::Nothing;
+					break;
+				}
+				uint8_t command = m_commands[m_command_index];
+				if ( command == CMD_GET_DEVICE_ID )
+				{
+					m_expect = Expect::Id;
+					break;
+				}
+				if ( ( command == CMD_ENABLE_REPORTING ) &&
+				     ( m_command_index == m_command_len - 1 ) )
+				{
+					m_streaming = true;
+					m_index = 0;
+				}
+				nextCommand();
+				break;
+			}
+			case Expect::Id:
+				m_device_id = b;
+				nextCommand();
+				break;
+		}
+	}
+
+	void nextCommand()
+	{
+		m_command_index++;
+		m_expect = ( m_command_index < m_command_len ) ? Expect::Ack
+		                                               : Expect::Nothing;
+	}
+
+	uint8_t packetSize() const
+	{
+		return ( ( m_device_id == 3 ) || ( m_device_id == 4 ) ) ? 4 : 3;
+	}
+
+	MousePacket decode() const
+	{
+		MousePacket p;
+		uint8_t status = m_packet[0];
+		p.buttons = status & BUTTONS_MASK;
+		p.dx = m_packet[1];
+		if ( status & STATUS_X_SIGN )
+		{
+			p.dx -= 256;
+		}
+		p.dy = m_packet[2];
+		if ( status & STATUS_Y_SIGN )
+		{
+			p.dy -= 256;
+		}
+		p.wheel = 0;
+		if ( m_device_id == 3 )
+		{
+			p.wheel = (int8_t)m_packet[3];
+		}
+		else if ( m_device_id == 4 )
+		{
+			// Sign-extend the 4-bit Z movement
+			p.wheel = (int8_t)( m_packet[3] << 4 ) >> 4;
+			p.buttons |= m_packet[3] & EXTRA_BUTTONS_MASK;
+		}
+		return p;
+	}
+
+	/**
+	 * Add a packet to the queue, merging it with the newest one if the
+	 * buttons haven't changed (or if we have run out of room).
+	 */
+	void queuePacket( const MousePacket& p )
+	{
+		if ( m_queue_len != 0 )
+		{
+			MousePacket& last = m_queue[m_queue_len - 1];
+			if ( ( last.buttons == p.buttons ) || ( m_queue_len == QUEUE_LEN ) )
+			{
+				last.buttons = p.buttons;
+				last.dx = saturatingAdd( last.dx, p.dx );
+				last.dy = saturatingAdd( last.dy, p.dy );
+				last.wheel = saturatingAdd( last.wheel, p.wheel );
+				return;
+			}
+		}
+		m_queue[m_queue_len++] = p;
+	}
+
+	static int16_t clamp( int16_t value, int16_t min, int16_t max )
+	{
+		if ( value < min )
+		{
+			return min;
+		}
+		if ( value > max )
+		{
+			return max;
+		}
+		return value;
+	}
+
+	static int16_t saturatingAdd( int16_t a, int16_t b )
+	{
+		int32_t sum = (int32_t)a + (int32_t)b;
+		if ( sum > INT16_MAX )
+		{
+			return INT16_MAX;
+		}
+		if ( sum < INT16_MIN )
+		{
+			return INT16_MIN;
+		}
+		return sum;
+	}
+
+	static constexpr uint8_t CMD_ENABLE_REPORTING = 0xF4;
+	static constexpr uint8_t CMD_GET_DEVICE_ID = 0xF2;
+	static constexpr uint8_t RESPONSE_ACK = 0xFA;
+	static constexpr uint8_t BAT_COMPLETE = 0xAA;
+	static constexpr uint8_t BUTTONS_MASK = 0x07;
+	static constexpr uint8_t EXTRA_BUTTONS_MASK = 0x30;
+	static constexpr uint8_t STATUS_ALWAYS_ONE = 0x08;
+	static constexpr uint8_t STATUS_X_SIGN = 0x10;
+	static constexpr uint8_t STATUS_Y_SIGN = 0x20;
+	static constexpr uint8_t QUEUE_LEN = 4;
+	static constexpr uint8_t MAX_COMMAND_LEN = 16;
+
+	bool m_streaming;
+	Expect m_expect;
+	uint8_t m_device_id;
+	uint8_t m_index;
+	uint8_t m_packet[4];
+	uint8_t m_commands[MAX_COMMAND_LEN];
+	uint8_t m_command_len;
+	uint8_t m_command_index;
+	uint8_t m_queue_len;
+	MousePacket m_queue[QUEUE_LEN];
+};
@@ -0,0 +1,242 @@
+/**
+ * Neotron-IO automatic OSCCAL calibration.
+ *
+ * The 8 MHz internal-RC is only accurate to ±10%. To trim it, the host sends
+ * a continuous stream of `U` (0x55) characters at SYNC_BAUD. Sent back to
+ * back, 0x55 8N1 is a square wave, with a falling edge every two bit times.
+ *
+ * We timestamp the falling edges on RXD (PD0 / PCINT16) using the Timer1
+ * ticks from `ticks.h`. Timer1's input capture pin isn't wired to RXD, so
+ * the pin-change interrupt stands in for it. Once we have summed
+ * enough edge-to-edge intervals, `poll` compares the total against what it
+ * should be and steps OSCCAL up or down, until the error is small or we start
+ * to hunt around the best value.
+ *
+ * It only listens once asked to (by the `C` command, or in calibration
+ * mode). If no measurement finishes for `TIMEOUT_MS` - the host has stopped
+ * sending, or never started - the run is abandoned and OSCCAL is put back
+ * as it was.
+ *
+ * The USART receiver is left running, so the `U` characters just turn up in
+ * the receive buffer and are ignored.
+ *
+ * This project is also licensed under the GPL (v3 or later version, at your
+ * choice). See the [LICENCE](./LICENCE) file.
+ */
+
+#include "ticks.h"
+
+enum class OscCalState
+{
+	Idle,
+	Measuring,
+	Done,
+	Failed,
+	TimedOut
+};
+
+/**
+ * Trims OSCCAL against a sync stream from the host.
+ */
+class OscCalibrator
+{
+   public:
+	OscCalibrator()
+	    : m_state( OscCalState::Idle ),
+	      m_have_last_edge( false ),
+	      m_last_edge( 0 ),
+	      m_sum( 0 ),
+	      m_count( 0 ),
+	      m_measure_start( 0 ),
+	      m_steps( 0 ),
+	      m_in_tolerance( 0 ),
+	      m_direction_changes( 0 ),
+	      m_last_direction( 0 ),
+	      m_start_osccal( 0 ),
+	      m_best_osccal( 0 ),
+	      m_best_error( UINT16_MAX )
+	{
+	}
+
+	/// The host must send the sync stream at this rate
+	static constexpr uint32_t SYNC_BAUD = 9600;
+
+	/**
+	 * Start listening for the sync stream.
+	 */
+	void start()
+	{
+		PCMSK2 &= ~_BV( PCINT16 );
+		m_have_last_edge = false;
+		m_sum = 0;
+		m_count = 0;
+		m_steps = 0;
+		m_in_tolerance = 0;
+		m_direction_changes = 0;
+		m_last_direction = 0;
+		m_measure_start = millis();
+		m_start_osccal = OSCCAL;
+		m_best_osccal = OSCCAL;
+		m_best_error = UINT16_MAX;
+		m_state = OscCalState::Measuring;
+		PCIFR = _BV( PCIF2 );
+		PCMSK2 |= _BV( PCINT16 );
+		PCICR |= _BV( PCIE2 );
+	}
+
+	OscCalState state() const { return m_state; }
+
+	/**
+	 * Call this from the PCINT2 interrupt.
+	 */
+	void onRxPinChange()
+	{
+		uint16_t now = ticksNow();
+		if ( ( m_state != OscCalState::Measuring ) || ( PIND & _BV( 0 ) ) )
+		{
+			// Only falling edges are interesting
+			return;
+		}
+		if ( m_have_last_edge && ( m_count < SUM_INTERVALS ) )
+		{
+			uint16_t interval = now - m_last_edge;
+			// Gaps between characters give longer intervals - skip them
+			if ( ( interval >= INTERVAL_MIN ) && ( interval <= INTERVAL_MAX ) )
+			{
+				m_sum += interval;
+				m_count++;
+			}
+		}
+		m_last_edge = now;
+		m_have_last_edge = true;
+	}
+
+	/**
+	 * Checks for a finished measurement and trims OSCCAL.
+	 *
+	 * @return true if calibration has just finished (see `state`).
+	 */
+	bool poll()
+	{
+		if ( m_state != OscCalState::Measuring )
+		{
+			return false;
+		}
+		if ( m_count < SUM_INTERVALS )
+		{
+			if ( ( millis() - m_measure_start ) < TIMEOUT_MS )
+			{
+				return false;
+			}
+			// No sync stream - give up, and leave OSCCAL as we found it
+			PCMSK2 &= ~_BV( PCINT16 );
+			OSCCAL = m_start_osccal;
+			m_state = OscCalState::TimedOut;
+			return true;
+		}
+
+		// If we measure more ticks than expected, our clock is fast.
+		int16_t error = (int16_t)( m_sum - EXPECTED_SUM );
+		uint16_t abs_error = ( error < 0 ) ? -error : error;
+		if ( abs_error < m_best_error )
+		{
+			m_best_error = abs_error;
+			m_best_osccal = OSCCAL;
+		}
+
+		int8_t direction = 0;
+		if ( abs_error <= TOLERANCE )
+		{
+			m_in_tolerance++;
+		}
+		else
+		{
+			m_in_tolerance = 0;
+			direction = ( error > 0 ) ? -1 : 1;
+		}
+
+		if ( ( direction != 0 ) && ( m_last_direction != 0 ) &&
+		     ( direction != m_last_direction ) )
+		{
+			m_direction_changes++;
+		}
+		m_last_direction = direction;
+
+		uint8_t osccal = OSCCAL;
+		// Bit 7 picks one of two overlapping ranges - don't step across it.
+		bool at_limit = ( ( direction > 0 ) && ( ( osccal & 0x7F ) == 0x7F ) ) ||
+		                ( ( direction < 0 ) && ( ( osccal & 0x7F ) == 0x00 ) );
+
+		if ( ( m_in_tolerance >= GOOD_MEASUREMENTS ) ||
+		     ( m_direction_changes >= MAX_DIRECTION_CHANGES ) ||
+		     ( m_steps >= MAX_STEPS ) || at_limit )
+		{
+			finish();
+			return true;
+		}
+
+		if ( direction != 0 )
+		{
+			OSCCAL = osccal + direction;
+			m_steps++;
+		}
+
+		// Measure again with the new setting
+		m_measure_start = millis();
+		noInterrupts();
+		m_have_last_edge = false;
+		m_sum = 0;
+		m_count = 0;
+		interrupts();
+		return false;
+	}
+
+#ifndef TEST_MODE_NO_PRIVATE
+   private:
+#endif
+
+	/**
+	 * Settle on the best value we saw.
+	 */
+	void finish()
+	{
+		PCMSK2 &= ~_BV( PCINT16 );
+		OSCCAL = m_best_osccal;
+		m_state = ( m_best_error <= MAX_ERROR ) ? OscCalState::Done
+		                                        : OscCalState::Failed;
+	}
+
+	/// The 0x55 stream has a falling edge every two bit times
+	static constexpr uint16_t INTERVAL_NOMINAL =
+	    ( 2 * TICKS_PER_SECOND ) / SYNC_BAUD;
+	static constexpr uint16_t INTERVAL_MIN = ( INTERVAL_NOMINAL * 3 ) / 4;
+	static constexpr uint16_t INTERVAL_MAX = ( INTERVAL_NOMINAL * 5 ) / 4;
+	static constexpr uint8_t SUM_INTERVALS = 16;
+	static constexpr uint16_t EXPECTED_SUM =
+	    ( 2 * TICKS_PER_SECOND * SUM_INTERVALS ) / SYNC_BAUD;
+	/// 0.5% is as close as we try to get
+	static constexpr uint16_t TOLERANCE = EXPECTED_SUM / 200;
+	/// 2% still gives a working UART at any of the supported baud rates
+	static constexpr uint16_t MAX_ERROR = EXPECTED_SUM / 50;
+	static constexpr uint8_t GOOD_MEASUREMENTS = 3;
+	static constexpr uint8_t MAX_DIRECTION_CHANGES = 4;
+	static constexpr uint8_t MAX_STEPS = 64;
+	/// Give up if a measurement takes longer than this, in milliseconds
+	static constexpr unsigned long TIMEOUT_MS = 1000;
+
+	volatile OscCalState m_state;
+	volatile bool m_have_last_edge;
+	volatile uint16_t m_last_edge;
+	volatile uint16_t m_sum;
+	volatile uint8_t m_count;
+	/// When the current measurement started, from `millis()`
+	unsigned long m_measure_start;
+	uint8_t m_steps;
+	uint8_t m_in_tolerance;
+	uint8_t m_direction_changes;
+	int8_t m_last_direction;
+	/// OSCCAL as it was before `start`, to go back to on a timeout
+	uint8_t m_start_osccal;
+	uint8_t m_best_osccal;
+	uint16_t m_best_error;
+};
@@ -0,0 +1,329 @@
+/**
+ * Neotron-IO host output arbiter.
+ *
+ * Everything for the host is queued by where it came from, and `poll` moves
+ * whole messages into the UART's transmit buffer, in strict priority order:
+ *
+ * 1. Urgent - command replies, keyboard data and most indications.
+ * 2. Joystick 1 and 2 - just the latest state of each, with a dirty flag.
+ *    A scan overwrites the state, and it's only turned into a message when
+ *    there is room in the UART to send one, so however often a joystick
+ *    changes, it never has more than one message's worth waiting.
+ * 3. Mouse - movement packets, which the `MouseAssembler` holds back (and
+ *    adds together) when this lane is full, and the mouse's replies. The
+ *    packets never take the last `MOUSE_RESERVE` bytes, so there is always
+ *    room for the reply to a host command.
+ *
+ * A message is only moved once there is room for all of it, so messages
+ * from different lanes never get mixed up. If the next urgent message
+ * doesn't fit, nothing else is moved either, so it can't be starved by lower
+ * lanes stealing the space a byte at a time.
+ *
+ * A message that doesn't fit in its lane is dropped whole, and counted.
+ *
+ * This project is also licensed under the GPL (v3 or later version, at your
+ * choice). See the [LICENCE](./LICENCE) file.
+ */
+
+#include <assert.h>
+#include <string.h>
+
+#include "RingBuf.h"
+
+enum class OutputLane : uint8_t
+{
+	Urgent,
+	Mouse
+};
+
+/**
+ * Whole messages, each stored as a length byte and then the message.
+ */
+template <size_t S>
+class MessageQueue
+{
+   public:
+	/**
+	 * Add a message, if there's room for all of it.
+	 */
+	bool push( const char* data, uint8_t data_len )
+	{
+		if ( spaceAvailable() < data_len )
+		{
+			return false;
+		}
+		m_buffer.push( (char)data_len );
+		m_buffer.pushN( data, data_len );
+		return true;
+	}
+
+	/**
+	 * How long is the next message? Zero if there isn't one.
+	 */
+	uint8_t peekLength()
+	{
+		char len;
+		return m_buffer.peek( len ) ? (uint8_t)len : 0;
+	}
+
+	/**
+	 * Take the next message. `out` must have room for `peekLength` bytes.
+	 */
+	uint8_t pop( char* out )
+	{
+		char len;
+		if ( !m_buffer.pop( len ) )
+		{
+			return 0;
+		}
+		return m_buffer.popN( out, (uint8_t)len );
+	}
+
+	/**
+	 * How long a message would fit?
+	 */
+	size_t spaceAvailable()
+	{
+		size_t space = m_buffer.maxSize() - m_buffer.size();
+		return ( space != 0 ) ? ( space - 1 ) : 0;
+	}
+
+	bool isEmpty() { return m_buffer.isEmpty(); }
+
+#ifndef TEST_MODE_NO_PRIVATE
+   private:
+#endif
+
+	RingBuf<char, S> m_buffer;
+};
+
+/**
+ * The latest state of one joystick, and whether the host has seen it yet.
+ */
+class JoystickSlot
+{
+   public:
+	JoystickSlot() : m_state( 0 ), m_dirty( false ) {}
+
+	/**
+	 * Replace the state, whether or not the old one was sent.
+	 */
+	void set( uint16_t state )
+	{
+		m_state = state;
+		m_dirty = true;
+	}
+
+	bool isDirty() const { return m_dirty; }
+
+	/**
+	 * Get the state to send, and mark it as seen.
+	 */
+	uint16_t take()
+	{
+		m_dirty = false;
+		return m_state;
+	}
+
+#ifndef TEST_MODE_NO_PRIVATE
+   private:
+#endif
+
+	uint16_t m_state;
+	bool m_dirty;
+};
+
+/**
+ * Turns a joystick state into a message for the host, returning the length.
+ * `out` has room for `MAX_JOYSTICK_MESSAGE` bytes.
+ */
+typedef uint8_t ( *JoystickFormatter )( uint8_t joystick,
+                                        uint16_t state,
+                                        char* out );
+
+/**
+ * The per-source queues, and the arbiter that feeds the UART from them.
+ */
+template <typename UART,
+          size_t URGENT_SIZE,
+          size_t MOUSE_SIZE,
+          size_t MOUSE_RESERVE = 0>
+class HostOutput
+{
+   public:
+	/// The longest message we can move in one go
+	static constexpr uint8_t MAX_MESSAGE = 48;
+	/// The longest joystick message (an ASCII `sxxxx` line)
+	static constexpr uint8_t MAX_JOYSTICK_MESSAGE = 6;
+	static constexpr uint8_t NUM_JOYSTICKS = 2;
+
+	/**
+	 * Construct a new HostOutput object.
+	 *
+	 * @param uart where the messages go
+	 * @param format_joystick builds a joystick message, at the point it is
+	 * sent
+	 */
+	HostOutput( UART& uart, JoystickFormatter format_joystick )
+	    : m_uart( uart ), m_format_joystick( format_joystick ), m_dropped( 0 )
+	{
+	}
+
+	/**
+	 * Queue a whole message for the host.
+	 *
+	 * @return false if there wasn't room, so it was dropped.
+	 */
+	bool send( OutputLane lane, const char* data, uint8_t data_len )
+	{
+		assert( data_len <= MAX_MESSAGE );
+		bool sent = false;
+		switch ( lane )
+		{
+			case OutputLane::Urgent:
+				sent = m_urgent.push( data, data_len );
+				break;
+			case OutputLane::Mouse:
+				sent = m_mouse.push( data, data_len );
+				break;
+		}
+		if ( !sent )
+		{
+			m_dropped += data_len;
+		}
+		return sent;
+	}
+
+	/**
+	 * Note the latest state of a joystick, to be sent when there's room.
+	 */
+	void setJoystick( uint8_t joystick, uint16_t state )
+	{
+		m_joysticks[joystick].set( state );
+	}
+
+	/**
+	 * How long a message would fit in the mouse lane?
+	 */
+	size_t mouseSpaceAvailable() { return m_mouse.spaceAvailable(); }
+
+	/**
+	 * How long a movement packet would fit in the mouse lane, leaving the
+	 * reserved room alone?
+	 */
+	size_t mousePacketSpace()
+	{
+		size_t space = m_mouse.spaceAvailable();
+		return ( space > MOUSE_RESERVE ) ? ( space - MOUSE_RESERVE ) : 0;
+	}
+
+	/**
+	 * How long a message would fit in the urgent lane?
+	 */
+	size_t urgentSpaceAvailable() { return m_urgent.spaceAvailable(); }
+
+	/**
+	 * Is the urgent lane empty?
+	 */
+	bool isUrgentEmpty() { return m_urgent.isEmpty(); }
+
+	/**
+	 * Is every lane empty?
+	 */
+	bool isEmpty()
+	{
+		return m_urgent.isEmpty() && !m_joysticks[0].isDirty() &&
+		       !m_joysticks[1].isDirty() && m_mouse.isEmpty();
+	}
+
+	/**
+	 * Move as many whole messages into the UART as will fit, highest
+	 * priority first.
+	 */
+	void poll()
+	{
+		while ( true )
+		{
+			Move move = moveMessage( m_urgent );
+			for ( uint8_t i = 0; i < NUM_JOYSTICKS; i++ )
+			{
+				if ( move != Move::Empty )
+				{
+					break;
+				}
+				move = moveJoystick( i );
+			}
+			if ( move == Move::Empty )
+			{
+				move = moveMessage( m_mouse );
+			}
+			if ( move != Move::Moved )
+			{
+				// Nothing left, or no room for the next one in line
+				return;
+			}
+		}
+	}
+
+	/**
+	 * How many bytes have been dropped because their lane was full, since
+	 * `clearDropped` (wraps round at 0xFFFF).
+	 */
+	uint16_t dropped() const { return m_dropped; }
+
+	void clearDropped() { m_dropped = 0; }
+
+#ifndef TEST_MODE_NO_PRIVATE
+   private:
+#endif
+
+	enum class Move : uint8_t
+	{
+		Empty,
+		NoRoom,
+		Moved
+	};
+
+	template <typename LANE>
+	Move moveMessage( LANE& lane )
+	{
+		uint8_t len = lane.peekLength();
+		if ( len == 0 )
+		{
+			return Move::Empty;
+		}
+		if ( m_uart.spaceAvailable() < len )
+		{
+			return Move::NoRoom;
+		}
+		char message[MAX_MESSAGE];
+		lane.pop( message );
+		m_uart.write( message, len );
+		return Move::Moved;
+	}
+
+	Move moveJoystick( uint8_t joystick )
+	{
+		JoystickSlot& slot = m_joysticks[joystick];
+		if ( !slot.isDirty() )
+		{
+			return Move::Empty;
+		}
+		if ( m_uart.spaceAvailable() < MAX_JOYSTICK_MESSAGE )
+		{
+			// Leave it - it may well change again before there's room
+			return Move::NoRoom;
+		}
+		char message[MAX_JOYSTICK_MESSAGE];
+		uint8_t len = m_format_joystick( joystick, slot.take(), message );
+		m_uart.write( message, len );
+		return Move::Moved;
+	}
+
+	UART& m_uart;
+	JoystickFormatter m_format_joystick;
+	MessageQueue<URGENT_SIZE> m_urgent;
+	JoystickSlot m_joysticks[NUM_JOYSTICKS];
+	MessageQueue<MOUSE_SIZE> m_mouse;
+	uint16_t m_dropped;
+};
@@ -0,0 +1,160 @@
+/**
+ * Neotron-IO compile-time pin to port mapping.
+ *
+ * Works out which AtMega328P port and bit an Arduino pin number is on, so a
+ * whole port can be read at once and the bits picked out with constant
+ * shifts. This uses MiniCore's numbering, where pins 20 and 21 are PB6 and
+ * PB7 (the XTAL pins, which are free when running from the internal-RC).
+ *
+ * This project is also licensed under the GPL (v3 or later version, at your
+ * choice). See the [LICENCE](./LICENCE) file.
+ */
+
+#ifndef PORT_H
+#define PORT_H
+
+#include "DigitalPin.h"
+
+enum class AvrPort : uint8_t
+{
+	B,
+	C,
+	D
+};
+
+/**
+ * Which port is this Arduino pin on?
+ */
+constexpr AvrPort pinPort( int pin )
+{
+	return ( pin < 8 ) ? AvrPort::D
+	                   : ( pin < 14 ) ? AvrPort::B
+	                                  : ( pin < 20 ) ? AvrPort::C : AvrPort::B;
+}
+
+/**
+ * Which bit of its port is this Arduino pin?
+ */
+constexpr uint8_t pinBit( int pin )
+{
+	return ( pin < 8 ) ? pin : ( pin < 14 ) ? ( pin - 8 ) : ( pin - 14 );
+}
+
+/**
+ * The mask for this Arduino pin within its port.
+ */
+constexpr uint8_t pinMask( int pin )
+{
+	return 1 << pinBit( pin );
+}
+
+/**
+ * Which Arduino pin is this bit of PORTB? PB6 and PB7 (the crystal pins)
+ * come after A0 to A5.
+ */
+constexpr int portBPin( uint8_t bit )
+{
+	return ( bit < 6 ) ? ( 8 + bit ) : ( 14 + bit );
+}
+
+/**
+ * Which Arduino pin is this bit of this port? The reverse of `pinPort` and
+ * `pinBit`.
+ */
+constexpr int portPin( AvrPort port, uint8_t bit )
+{
+	return ( port == AvrPort::D )
+	           ? bit
+	           : ( port == AvrPort::C ) ? ( 14 + bit ) : portBPin( bit );
+}
+
+/**
+ * The input ports, all read at the same moment.
+ */
+struct PortSnapshot
+{
+#ifdef SLOW_IO_FUNCTIONS
+	// No port registers on this target, so read the pins one at a time.
+	template <int PIN>
+	bool isLow() const
+	{
+		return fastDigitalRead( PIN ) == 0;
+	}
+#else
+	uint8_t pinb;
+	uint8_t pinc;
+	uint8_t pind;
+
+	template <int PIN>
+	bool isLow() const
+	{
+		return ( ( port( pinPort( PIN ) ) >> pinBit( PIN ) ) & 1 ) == 0;
+	}
+
+	uint8_t port( AvrPort p ) const
+	{
+		return ( p == AvrPort::D ) ? pind : ( p == AvrPort::B ) ? pinb : pinc;
+	}
+#endif
+};
+
+/**
+ * Read all the input ports.
+ */
+static inline PortSnapshot readPorts()
+{
+	PortSnapshot result;
+#ifndef SLOW_IO_FUNCTIONS
+	result.pinb = PINB;
+	result.pinc = PINC;
+	result.pind = PIND;
+#endif
+	return result;
+}
+
+/**
+ * Read one whole input port.
+ */
+template <AvrPort P>
+static inline uint8_t readPort()
+{
+#ifdef SLOW_IO_FUNCTIONS
+	uint8_t result = 0;
+	for ( uint8_t bit = 0; bit < 8; bit++ )
+	{
+		if ( fastDigitalRead( portPin( P, bit ) ) )
+		{
+			result |= 1 << bit;
+		}
+	}
+	return result;
+#else
+	return ( P == AvrPort::D ) ? PIND : ( P == AvrPort::B ) ? PINB : PINC;
+#endif
+}
+
+#ifndef SLOW_IO_FUNCTIONS
+/**
+ * The pin-change mask register for this port. Each port has its own PCINT
+ * group, numbered in the same order as `AvrPort` - PCINT0 is PORTB, PCINT1
+ * is PORTC and PCINT2 is PORTD - and the bits match the port bits.
+ */
+template <AvrPort P>
+static inline volatile uint8_t& pcintMaskRegister()
+{
+	return ( P == AvrPort::B ) ? PCMSK0 : ( P == AvrPort::C ) ? PCMSK1 : PCMSK2;
+}
+
+/**
+ * Turn on pin-change interrupts for the given pins of this port.
+ */
+template <AvrPort P>
+static inline void enablePinChange( uint8_t mask )
+{
+	pcintMaskRegister<P>() |= mask;
+	PCIFR = _BV( (uint8_t)P );
+	PCICR |= _BV( (uint8_t)P );
+}
+#endif
+
+#endif  // PORT_H
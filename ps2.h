@@ -11,6 +11,13 @@
  * This driver is for generic PS/2 devices and doesn't understand the
  * difference between a keyboard and a mouse.
  *
+ * Each call to `writeBuffer` is one transaction. After each byte goes out we
+ * wait for the device to answer. An ACK (`FA`) moves us on to the next byte,
+ * and is passed up like any other byte. A Resend (`FE`) is swallowed and the
+ * byte goes again, up to `MAX_TRIES` times. Anything else, or no answer at
+ * all, fails the transaction and the rest of its bytes are dropped. Either
+ * way, `readCompletion` then tells you how the transaction went.
+ *
  * This project is also licensed under the GPL (v3 or later version, at your
  * choice). See the [LICENCE](./LICENCE) file.
  */
@@ -20,6 +27,7 @@
 
 #include "DigitalPin.h"
 #include "RingBuf.h"
+#include "ticks.h"
 
 enum class Ps2State
 {
@@ -30,6 +38,35 @@ enum class Ps2State
 	Disabled
 };
 
+/**
+ * How a transaction given to `writeBuffer` ended.
+ */
+enum class Ps2WriteResult : uint8_t
+{
+	/// Every byte was ACKed
+	Ok = 0,
+	/// The device kept asking for a byte again
+	TooManyResends = 1,
+	/// The device stopped clocking, or didn't answer in time
+	NoResponse = 2,
+	/// The device answered with something other than ACK or Resend
+	Error = 3
+};
+
+/**
+ * How often things have gone wrong on a port, since the counters were last
+ * cleared. Each one wraps round at 0xFFFF.
+ */
+struct Ps2Counters
+{
+	/// Words with a bad start bit, stop bit or parity
+	uint16_t word_errors;
+	/// Reads or writes where the device stopped clocking part way through
+	uint16_t timeouts;
+	/// Times the input buffer filled up and we held the device off
+	uint16_t buffer_full;
+};
+
 enum class Ps2WriteState
 {
 	HoldingClock,
@@ -42,16 +79,31 @@ enum class Ps2WriteState
 
 /**
  * Represents a generic PS2 device.
+ *
+ * If INTERRUPT_DRIVEN is true, incoming words are clocked in by
+ * `onPinChange()`, which you must call from a pin-change interrupt on the
+ * clock pin, or by `onClockEdge()`, which a `Ps2Bus` calls. `poll()` then only
+ * handles writes and timeouts.
+ *
+ * Once HIGH_WATERMARK bytes are waiting in the input buffer, we inhibit the
+ * clock at the end of the word, so the device holds on to anything else
+ * itself. We let go again once `readBuffer` has taken it down to
+ * LOW_WATERMARK. The device only ever stops between whole bytes, and there
+ * is room left over for the rest of a packet already on its way.
  */
-template <int PIN_CLK, int PIN_DAT>
+template <int PIN_CLK,
+          int PIN_DAT,
+          bool INTERRUPT_DRIVEN = false,
+          uint8_t HIGH_WATERMARK = 24,
+          uint8_t LOW_WATERMARK = 8>
 class Ps2
 {
    public:
 	/**
 	 * Construct a new Ps2 object.
 	 *
-	 * @param pin_clk the Arduino pin number for the PS/2 clock pin
-	 * @param pin_data the Arduino pin number for the PS/2 data pin
+	 * PIN_CLK is the Arduino pin number for the PS/2 clock pin and PIN_DAT is
+	 * the Arduino pin number for the PS/2 data pin.
 	 */
 	Ps2()
 	    : m_state( Ps2State::Idle ),
@@ -61,7 +113,14 @@ class Ps2
 	      m_out_buffer(),
 	      m_current_word( 0 ),
 	      m_current_word_bitmask( 1 ),
-	      m_timeout( 0 )
+	      m_timeout_start( 0 ),
+	      m_timeout_ticks( 0 ),
+	      m_awaiting_response( false ),
+	      m_response_ready( false ),
+	      m_response( 0 ),
+	      m_response_started( 0 ),
+	      m_tries( 0 ),
+	      m_counters()
 	{
 		// Use internal pull-ups
 		pinMode( PIN_CLK, INPUT_PULLUP );
@@ -78,6 +137,39 @@ class Ps2
 		       ( m_state == Ps2State::WritingWord );
 	}
 
+	/**
+	 * Is there nothing at all going on? No word in flight, no write waiting
+	 * to go or waiting for an answer, and nothing to be read. Safe to call
+	 * with interrupts off.
+	 */
+	bool isQuiet()
+	{
+		return ( m_state == Ps2State::Idle ) && !m_awaiting_response &&
+		       m_out_buffer.isEmpty() && m_in_buffer.isEmpty() &&
+		       m_completions.isEmpty();
+	}
+
+	/**
+	 * Get a copy of the error counters.
+	 */
+	Ps2Counters counters()
+	{
+		noInterrupts();
+		Ps2Counters result = m_counters;
+		interrupts();
+		return result;
+	}
+
+	/**
+	 * Set all the error counters back to zero.
+	 */
+	void clearCounters()
+	{
+		noInterrupts();
+		m_counters = Ps2Counters();
+		interrupts();
+	}
+
 	/**
 	 * Checks the clock pin and reads a bit as required.
 	 *
@@ -85,6 +177,10 @@ class Ps2
 	 */
 	void poll()
 	{
+		if ( m_awaiting_response )
+		{
+			pollResponse();
+		}
 		switch ( m_state )
 		{
 			case Ps2State::Idle:
@@ -102,6 +198,49 @@ class Ps2
 		}
 	}
 
+	static constexpr int CLK_PIN = PIN_CLK;
+	static constexpr int DAT_PIN = PIN_DAT;
+
+	/**
+	 * Handles a change on the clock pin. Call this from the pin-change
+	 * interrupt when INTERRUPT_DRIVEN is true.
+	 */
+	void onPinChange()
+	{
+		onClockEdge( fastDigitalRead( PIN_CLK ), fastDigitalRead( PIN_DAT ) );
+	}
+
+	/**
+	 * Handles a change on the clock pin, given both pin levels sampled at the
+	 * same moment.
+	 *
+	 * Data is used on each falling clock edge. Edges are ignored while we
+	 * are writing, or while the port is disabled.
+	 */
+	void onClockEdge( bool clk_pin, bool dat_pin )
+	{
+		if ( clk_pin == m_last_clk )
+		{
+			return;
+		}
+		m_last_clk = clk_pin;
+		if ( ( m_state == Ps2State::Idle ) && !clk_pin )
+		{
+			// A falling edge while idle is the start bit
+			m_current_word = 0;
+			m_current_word_bitmask = 1;
+			m_state = Ps2State::ReadingWord;
+		}
+		if ( m_state == Ps2State::ReadingWord )
+		{
+			if ( !clk_pin )
+			{
+				clockInBit( dat_pin );
+			}
+			setTimeout( BIT_TIMEOUT );
+		}
+	}
+
 	/**
 	 * Disables the PS/2 port by holding the clock line low.
 	 *
@@ -138,19 +277,31 @@ class Ps2
 	 * @param data the bytes to write to the device
 	 * @param data_len the number of bytes pointed to by `data`
 	 *
+	 * The bytes are one transaction, which ends up in `readCompletion`.
+	 *
 	 * @return true if space in internal buffer to accept all the bytes, false
 	 * if not enough space and write is rejected.
 	 */
 	bool writeBuffer( const uint8_t* data, size_t data_len )
 	{
-		if ( ( data_len + m_out_buffer.size() ) > m_out_buffer.maxSize() )
+		if ( ( data_len == 0 ) || m_transactions.isFull() ||
+		     ( ( data_len + m_out_buffer.size() ) > m_out_buffer.maxSize() ) )
 		{
 			return false;
 		}
-		for ( size_t i = 0; i < data_len; i++ )
-		{
-			m_out_buffer.push( data[i] );
-		}
+		m_out_buffer.pushN( data, data_len );
+		m_transactions.push( data_len );
+		return true;
+	}
+
+	/**
+	 * Find out how the oldest finished transaction went.
+	 *
+	 * @return true if a transaction had finished, false if not.
+	 */
+	bool readCompletion( Ps2WriteResult& result )
+	{
+		return m_completions.pop( result );
 	}
 
 	/**
@@ -164,9 +315,11 @@ class Ps2
 		}
 		else
 		{
+			// Safe against the ISR without locking - see `m_in_buffer`
 			uint8_t result;
 			m_in_buffer.pop( result );
-			if ( m_state == Ps2State::BufferFull )
+			if ( ( m_state == Ps2State::BufferFull ) &&
+			     ( m_in_buffer.size() <= LOW_WATERMARK ) )
 			{
 				renable();
 			}
@@ -180,8 +333,18 @@ class Ps2
 
 	void pollIdle()
 	{
-		if ( !m_out_buffer.isEmpty() )
+		if ( !m_out_buffer.isEmpty() && !m_awaiting_response )
 		{
+			if ( INTERRUPT_DRIVEN )
+			{
+				noInterrupts();
+				if ( m_state != Ps2State::Idle )
+				{
+					// The interrupt just saw a start bit - read that first
+					interrupts();
+					return;
+				}
+			}
 			// We are idle and we have words waiting to clock out
 			m_state = Ps2State::WritingWord;
 			m_write_state = Ps2WriteState::HoldingClock;
@@ -193,7 +356,18 @@ class Ps2
 			// 1) Bring the Clock line low for at least 100 microseconds
 			fastDigitalWrite( PIN_CLK, LOW );
 			pinMode( PIN_CLK, OUTPUT );
-			setTimeout( 150 );
+			setTimeout( CLOCK_TIMEOUT );
+			if ( INTERRUPT_DRIVEN )
+			{
+				interrupts();
+				return;
+			}
+		}
+
+		if ( INTERRUPT_DRIVEN )
+		{
+			// Edges are picked up by `onPinChange()`
+			return;
 		}
 
 		bool kb_clk_pin = fastDigitalRead( PIN_CLK );
@@ -207,11 +381,15 @@ class Ps2
 
 	void pollWritingWord()
 	{
-		if ( hasTimedOut() )
+		// While holding the clock, the timeout is how long we hold it for
+		if ( ( m_write_state != Ps2WriteState::HoldingClock ) && hasTimedOut() )
 		{
-			// Hmm ... keyboard stopped part way through for 1..2ms?
-			// Give up.
+			// Hmm ... device stopped part way through? Let go, and send the
+			// byte again.
+			m_counters.timeouts++;
 			renable();
+			retryOrFail( Ps2WriteResult::NoResponse );
+			return;
 		}
 		switch ( m_write_state )
 		{
@@ -238,7 +416,7 @@ class Ps2
 						// data line
 						pinMode( PIN_DAT, INPUT_PULLUP );
 						m_write_state = Ps2WriteState::WaitDataLow;
-						setTimeout( 150 );
+						setTimeout( CLOCK_TIMEOUT );
 					}
 					else
 					{
@@ -253,7 +431,7 @@ class Ps2
 						}
 						m_current_word_bitmask <<= 1;
 						m_write_state = Ps2WriteState::WaitClockHigh;
-						setTimeout( 150 );
+						setTimeout( CLOCK_TIMEOUT );
 					}
 				}
 				break;
@@ -263,7 +441,7 @@ class Ps2
 				if ( fastDigitalRead( PIN_CLK ) == HIGH )
 				{
 					m_write_state = Ps2WriteState::WaitClockLow;
-					setTimeout( 150 );
+					setTimeout( CLOCK_TIMEOUT );
 				}
 				break;
 			// 10) Wait for the device to bring data low (for the ACK)
@@ -271,7 +449,7 @@ class Ps2
 				if ( fastDigitalRead( PIN_DAT ) == LOW )
 				{
 					m_write_state = Ps2WriteState::WaitFinalClockLow;
-					setTimeout( 150 );
+					setTimeout( CLOCK_TIMEOUT );
 				}
 				break;
 			// 11) Wait for the device to bring clock low
@@ -279,24 +457,122 @@ class Ps2
 				if ( fastDigitalRead( PIN_CLK ) == LOW )
 				{
 					m_write_state = Ps2WriteState::WaitForRelease;
-					setTimeout( 150 );
+					setTimeout( CLOCK_TIMEOUT );
 				}
 				break;
 			case Ps2WriteState::WaitForRelease:
 				if ( ( fastDigitalRead( PIN_CLK ) == HIGH ) &&
 				     ( fastDigitalRead( PIN_DAT ) == HIGH ) )
 				{
-					// All done, so remove from buffer
-					uint8_t b;
-					m_out_buffer.pop( b );
-					renable();
+					onByteSent();
 				}
 				break;
 		}
 	}
 
+	/**
+	 * The byte at the head of the out buffer has gone. Leave it there until
+	 * the device answers, and let go of the lines so it can.
+	 */
+	void onByteSent()
+	{
+		m_response_ready = false;
+		m_response_started = ticksNow();
+		m_awaiting_response = true;
+		renable();
+	}
+
+	/**
+	 * Deal with the device's answer to the byte we just sent.
+	 */
+	void pollResponse()
+	{
+		if ( m_response_ready )
+		{
+			uint8_t sent;
+			m_out_buffer.peek( sent );
+			m_awaiting_response = false;
+			if ( m_response == RESPONSE_RESEND )
+			{
+				retryOrFail( Ps2WriteResult::TooManyResends );
+			}
+			else if ( ( m_response == RESPONSE_ACK ) ||
+			          ( sent == COMMAND_ECHO ) || ( sent == COMMAND_RESEND ) )
+			{
+				// Echo and Resend are answered without an ACK
+				finishByte( Ps2WriteResult::Ok );
+			}
+			else
+			{
+				finishByte( Ps2WriteResult::Error );
+			}
+		}
+		else if ( ( m_state == Ps2State::Idle ) &&
+		          ( ( uint16_t )( ticksNow() - m_response_started ) >=
+		            RESPONSE_TIMEOUT ) )
+		{
+			m_awaiting_response = false;
+			finishByte( Ps2WriteResult::NoResponse );
+		}
+	}
+
+	/**
+	 * The byte at the head of the out buffer didn't get through. Leave it
+	 * there to go again, unless we've tried enough times already.
+	 */
+	void retryOrFail( Ps2WriteResult result )
+	{
+		m_tries++;
+		if ( m_tries >= MAX_TRIES )
+		{
+			finishByte( result );
+		}
+	}
+
+	/**
+	 * We're done with the byte at the head of the out buffer. If it failed,
+	 * the rest of its transaction is dropped too.
+	 */
+	void finishByte( Ps2WriteResult result )
+	{
+		m_tries = 0;
+		uint8_t& remaining = m_transactions[0];
+		if ( result == Ps2WriteResult::Ok )
+		{
+			m_out_buffer.consume( 1 );
+			remaining--;
+		}
+		else
+		{
+			m_out_buffer.consume( remaining );
+			remaining = 0;
+		}
+		if ( remaining == 0 )
+		{
+			uint8_t done;
+			m_transactions.pop( done );
+			m_completions.push( result );
+		}
+	}
+
 	void pollReadingWord()
 	{
+		if ( INTERRUPT_DRIVEN )
+		{
+			// Only the timeout is handled here. Check it with interrupts off
+			// so we don't race against a bit arriving.
+			noInterrupts();
+			if ( ( m_state == Ps2State::ReadingWord ) && hasTimedOut() )
+			{
+				m_counters.timeouts++;
+				m_state = Ps2State::Idle;
+				m_current_word_bitmask = 1;
+				m_current_word = 0;
+			}
+			interrupts();
+			return;
+		}
+
 		bool kb_clk_pin = fastDigitalRead( PIN_CLK );
 		if ( kb_clk_pin != m_last_clk )
 		{
@@ -304,27 +580,9 @@ class Ps2
 			if ( !kb_clk_pin )
 			{
 				// Falling edge
-				if ( fastDigitalRead( PIN_DAT ) )
-				{
-					m_current_word |= m_current_word_bitmask;
-				}
-				m_current_word_bitmask <<= 1;
-				if ( m_current_word_bitmask == PS2_INCOMING_MASK )
-				{
-					int result = validateWord( m_current_word );
-					if ( result >= 0 )
-					{
-						m_in_buffer.push( result );
-						if ( m_in_buffer.isFull() )
-						{
-							disable();
-							m_state = Ps2State::BufferFull;
-						}
-						m_current_word_bitmask = 1;
-					}
-				}
+				clockInBit( fastDigitalRead( PIN_DAT ) );
 			}
-			setTimeout( 250 );
+			setTimeout( BIT_TIMEOUT );
 			m_last_clk = kb_clk_pin;
 		}
 		else
@@ -333,6 +591,7 @@ class Ps2
 			{
 				// Hmm ... keyboard stopped part way through for 1..2ms?
 				// Give up.
+				m_counters.timeouts++;
 				m_state = Ps2State::Idle;
 				m_current_word_bitmask = 1;
 				m_current_word = 0;
@@ -341,76 +600,113 @@ class Ps2
 	}
 
 	/**
-	 * Waits for num_ms to 1+num_micros microseconds.
+	 * Stores one bit sampled on a falling clock edge. Once all 11 bits are
+	 * in, the word is checked and the byte goes into the input buffer.
+	 *
+	 * In interrupt-driven mode this runs inside the ISR, as the only producer
+	 * for the input buffer.
 	 */
-	void setTimeout( uint16_t num_micros )
+	void clockInBit( bool data_bit )
 	{
-		assert( num_micros < 32000 );
-		m_timeout = ( ( uint16_t )( micros() & 0xFFFF ) ) + num_micros;
+		if ( data_bit )
+		{
+			m_current_word |= m_current_word_bitmask;
+		}
+		m_current_word_bitmask <<= 1;
+		if ( m_current_word_bitmask == PS2_INCOMING_MASK )
+		{
+			int result = validateWord( m_current_word );
+			if ( result < 0 )
+			{
+				m_counters.word_errors++;
+			}
+			if ( ( result >= 0 ) && m_awaiting_response && !m_response_ready )
+			{
+				// This is the answer to the byte we just sent
+				m_response = result;
+				m_response_ready = true;
+				if ( result == RESPONSE_RESEND )
+				{
+					// We'll deal with this - don't pass it up
+					result = -1;
+				}
+			}
+			if ( result >= 0 )
+			{
+				m_in_buffer.push( result );
+				if ( m_in_buffer.size() >= HIGH_WATERMARK )
+				{
+					// We're between words, so this is a clean place to stop
+					disable();
+					m_state = Ps2State::BufferFull;
+					m_counters.buffer_full++;
+				}
+			}
+			// Get ready for the next word
+			m_current_word_bitmask = 1;
+			m_current_word = 0;
+		}
+	}
+
+	/**
+	 * Start a timeout of num_ticks (see `ticks.h`) from now.
+	 */
+	void setTimeout( uint16_t num_ticks )
+	{
+		m_timeout_start = ticksNow();
+		m_timeout_ticks = num_ticks;
 	}
 
 	/**
-	 * Has the timeout expired?
+	 * Has the timeout expired? Stays expired until `setTimeout` is called
+	 * again (or the tick count wraps round).
 	 */
 	bool hasTimedOut()
 	{
-		uint16_t now = micros() & 0xFFFF;
-		int16_t delta = m_timeout - now;
-		if ( delta <= 0 )
-		{
-			m_timeout = 0;
-			return true;
-		}
-		else
-		{
-			return false;
-		}
+		return ( uint16_t )( ticksNow() - m_timeout_start ) >= m_timeout_ticks;
 	}
 
-	static uint16_t encodeByte( uint8_t byte )
+	/**
+	 * Is an odd number of bits set in this byte? Folds the byte in half
+	 * until one bit is left, which is a few instructions with fixed shifts -
+	 * no loop and no table.
+	 */
+	static constexpr uint8_t oddParity( uint8_t b )
 	{
-		uint16_t result = 0;
-		bool parity = true;
-		for ( size_t i = 0; i < 8; i++ )
-		{
-			if ( bitRead( byte, i ) )
-			{
-				parity = !parity;
-			}
-		}
-		// Data byte (first bit is start bit, which is zero)
-		result |= ( (uint16_t)byte ) << 1;
-		// Parity bit
-		result |= ( parity ? 1 : 0 ) << 9;
-		// Stop bit
-		result |= 1 << 10;
-		return result;
+		return foldBits( foldBits( foldBits( b, 4 ), 2 ), 1 ) & 1;
+	}
+
+	static constexpr uint8_t foldBits( uint8_t b, uint8_t shift )
+	{
+		return b ^ ( b >> shift );
+	}
+
+	/**
+	 * Build the 11-bit word for a byte: a zero start bit, the data, an odd
+	 * parity bit and a one stop bit.
+	 */
+	static constexpr uint16_t encodeByte( uint8_t byte )
+	{
+		return ( (uint16_t)byte << FIRST_DATA_BIT ) |
+		       ( (uint16_t)( oddParity( byte ) ^ 1 ) << PARITY_BIT ) |
+		       ( 1 << STOP_BIT );
 	}
 
 	/**
 	 * Check an 11-bit word from the device.
+	 *
+	 * @return the data byte, or -1 if the start bit, stop bit or parity is
+	 * wrong.
 	 */
 	static int validateWord( uint16_t ps2_bits )
 	{
-		bool parity_bit = bitRead( ps2_bits, PARITY_BIT ) != 0;
-		bool start_bit = bitRead( ps2_bits, START_BIT ) != 0;
-		bool stop_bit = bitRead( ps2_bits, STOP_BIT ) != 0;
-		bool parity = parity_bit;
-		for ( uint8_t i = FIRST_DATA_BIT; i <= LAST_DATA_BIT; i++ )
-		{
-			if ( bitRead( ps2_bits, i ) )
-			{
-				parity = !parity;
-			}
-		}
-		if ( !start_bit && parity && stop_bit )
-		{
-			return ( ps2_bits >> 1 ) & 0x00FF;
-		}
-		else
-		{
-			return -1;
-		}
+		uint8_t data = ps2_bits >> FIRST_DATA_BIT;
+		// With the parity bit folded in, good data has an odd number of ones
+		uint8_t ones = data ^ ( ( ps2_bits >> PARITY_BIT ) & 1 );
+		// All the checks at once - zero only if every one of them passes
+		uint16_t bad = ( ( ps2_bits & FRAME_MASK ) ^ FRAME_GOOD ) |
+		               ( oddParity( ones ) ^ 1 );
+		return bad ? -1 : data;
 	}
 
 	static constexpr uint8_t PARITY_BIT = 9;
@@ -418,18 +714,54 @@ class Ps2
 	static constexpr uint8_t START_BIT = 0;
 	static constexpr uint8_t FIRST_DATA_BIT = 1;
 	static constexpr uint8_t LAST_DATA_BIT = 8;
+	/// The start and stop bits, and what they should be
+	static constexpr uint16_t FRAME_MASK =
+	    ( 1 << START_BIT ) | ( 1 << STOP_BIT );
+	static constexpr uint16_t FRAME_GOOD = 1 << STOP_BIT;
 	static constexpr size_t IN_BUFFER_SIZE = 32;
 	static constexpr size_t OUT_BUFFER_SIZE = 32;
+	static_assert( ( LOW_WATERMARK < HIGH_WATERMARK ) &&
+	                   ( HIGH_WATERMARK < IN_BUFFER_SIZE ),
+	               "Ps2 watermarks must be low < high < buffer size" );
 	static constexpr size_t PS2_INCOMING_MASK = 1 << 11;
 	static constexpr size_t PS2_OUTGOING_MASK = 1 << 10;
 	static constexpr uint16_t TIMEOUT_POLLS = 800;
+	static constexpr uint8_t RESPONSE_ACK = 0xFA;
+	static constexpr uint8_t RESPONSE_RESEND = 0xFE;
+	static constexpr uint8_t COMMAND_ECHO = 0xEE;
+	static constexpr uint8_t COMMAND_RESEND = 0xFE;
+	/// Longest gap between clock edges while reading a word
+	static constexpr uint16_t BIT_TIMEOUT = ticksFromMicros<250>();
+	/// How long we hold the clock to start a write, and the longest gap
+	/// between clock edges while writing
+	static constexpr uint16_t CLOCK_TIMEOUT = ticksFromMicros<150>();
+	/// Devices must answer a command within 20ms
+	static constexpr uint16_t RESPONSE_TIMEOUT = ticksFromMicros<20000>();
+	/// How many times we send a byte before giving up
+	static constexpr uint8_t MAX_TRIES = 3;
+	/// How many `writeBuffer` calls can be queued at once
+	static constexpr uint8_t MAX_TRANSACTIONS = 8;
+	static constexpr uint8_t MAX_COMPLETIONS = 4;
 
-	Ps2State m_state;
+	volatile Ps2State m_state;
 	Ps2WriteState m_write_state;
-	bool m_last_clk;
+	volatile bool m_last_clk;
 	uint16_t m_current_word;
 	size_t m_current_word_bitmask;
-	RingBuf<uint8_t, IN_BUFFER_SIZE> m_in_buffer;
+	/// Filled by `clockInBit` (maybe in the ISR), emptied by `readBuffer`
+	SpscRingBuf<uint8_t, IN_BUFFER_SIZE> m_in_buffer;
 	RingBuf<uint8_t, OUT_BUFFER_SIZE> m_out_buffer;
-	uint16_t m_timeout;
+	uint16_t m_timeout_start;
+	uint16_t m_timeout_ticks;
+	/// Set once a byte has gone, until the device answers it
+	volatile bool m_awaiting_response;
+	volatile bool m_response_ready;
+	volatile uint8_t m_response;
+	uint16_t m_response_started;
+	uint8_t m_tries;
+	/// How many bytes of each queued transaction are still in `m_out_buffer`
+	RingBuf<uint8_t, MAX_TRANSACTIONS> m_transactions;
+	RingBuf<Ps2WriteResult, MAX_COMPLETIONS> m_completions;
+	/// Partly updated in the ISR - use `counters` to read them
+	Ps2Counters m_counters;
 };
@@ -0,0 +1,105 @@
+/**
+ * Neotron-IO shared PS/2 bus.
+ *
+ * The keyboard and mouse clock and data lines all sit on one AVR port
+ * (PORTC). Rather than each `Ps2` reading its own pins, we read the port once
+ * and find the clock edges on both channels with one XOR against the last
+ * sample. Each changed channel gets its clock and data levels, sampled at the
+ * same moment, through `Ps2::onClockEdge`.
+ *
+ * The ports must have INTERRUPT_DRIVEN set, as it's the bus that feeds them
+ * edges. Call `onPinChange` from the pin-change interrupt, or set the bus's
+ * own INTERRUPT_DRIVEN to false and `poll` will sample the pins itself.
+ *
+ * While one port is part way through a transfer, `poll` only services that
+ * port, so the idle one doesn't start a write and slow it down.
+ *
+ * This project is also licensed under the GPL (v3 or later version, at your
+ * choice). See the [LICENCE](./LICENCE) file.
+ */
+
+#include "port.h"
+
+/**
+ * Two PS/2 ports on the same AVR port.
+ */
+template <typename PORT_A, typename PORT_B, bool INTERRUPT_DRIVEN>
+class Ps2Bus
+{
+	static_assert(
+	    ( pinPort( PORT_A::CLK_PIN ) == pinPort( PORT_A::DAT_PIN ) ) &&
+	        ( pinPort( PORT_A::CLK_PIN ) == pinPort( PORT_B::CLK_PIN ) ) &&
+	        ( pinPort( PORT_A::CLK_PIN ) == pinPort( PORT_B::DAT_PIN ) ),
+	    "Ps2Bus pins must all be on the same AVR port" );
+
+   public:
+	Ps2Bus( PORT_A& port_a, PORT_B& port_b )
+	    : m_port_a( port_a ), m_port_b( port_b ), m_last_sample( 0xFF )
+	{
+	}
+
+	/**
+	 * Sample the bus and pass on any clock edges. Call this from the
+	 * pin-change interrupt when INTERRUPT_DRIVEN is true.
+	 */
+	void onPinChange()
+	{
+		uint8_t sample = readPort<BUS_PORT>();
+		uint8_t changed = sample ^ m_last_sample;
+		m_last_sample = sample;
+		if ( changed & A_CLK )
+		{
+			m_port_a.onClockEdge( sample & A_CLK, sample & A_DAT );
+		}
+		if ( changed & B_CLK )
+		{
+			m_port_b.onClockEdge( sample & B_CLK, sample & B_DAT );
+		}
+	}
+
+	/**
+	 * Is either port part way through a transfer?
+	 */
+	bool isActive() { return m_port_a.isActive() || m_port_b.isActive(); }
+
+	/**
+	 * Is there nothing going on, on either port? See `Ps2::isQuiet`.
+	 */
+	bool isQuiet() { return m_port_a.isQuiet() && m_port_b.isQuiet(); }
+
+	/**
+	 * Handle writes and timeouts (and edges, if not INTERRUPT_DRIVEN).
+	 */
+	void poll()
+	{
+		if ( !INTERRUPT_DRIVEN )
+		{
+			onPinChange();
+		}
+		bool a_active = m_port_a.isActive();
+		bool b_active = m_port_b.isActive();
+		if ( a_active || !b_active )
+		{
+			m_port_a.poll();
+		}
+		if ( b_active || !a_active )
+		{
+			m_port_b.poll();
+		}
+	}
+
+#ifndef TEST_MODE_NO_PRIVATE
+   private:
+#endif
+
+	static constexpr AvrPort BUS_PORT = pinPort( PORT_A::CLK_PIN );
+	static constexpr uint8_t A_CLK = pinMask( PORT_A::CLK_PIN );
+	static constexpr uint8_t A_DAT = pinMask( PORT_A::DAT_PIN );
+	static constexpr uint8_t B_CLK = pinMask( PORT_B::CLK_PIN );
+	static constexpr uint8_t B_DAT = pinMask( PORT_B::DAT_PIN );
+
+	PORT_A& m_port_a;
+	PORT_B& m_port_b;
+	/// Only touched by `onPinChange`
+	uint8_t m_last_sample;
+};
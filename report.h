@@ -0,0 +1,238 @@
+/**
+ * Neotron-IO indication framing.
+ *
+ * Every indication we send the host - PS/2 bytes, joystick states, decoded
+ * keys and write-done results - is a source and a few bytes of payload.
+ * `formatReport` turns that into a message in whichever protocol the host
+ * has picked with the `P` command: an ASCII line (a tag letter, the payload
+ * hex-encoded, then a newline), or a binary frame (a `1cccllll` header byte,
+ * then the raw payload). `ReportBatcher` gathers PS/2 bytes up into fewer,
+ * longer indications.
+ *
+ * This project is also licensed under the GPL (v3 or later version, at your
+ * choice). See the [LICENCE](./LICENCE) file.
+ */
+
+#include <assert.h>
+#include <string.h>
+
+#include "hex.h"
+
+/**
+ * How we send indications to the host.
+ */
+enum class HostProtocol : uint8_t
+{
+	/// Tag letter, hex-encoded payload, newline (see the README)
+	Ascii = 0,
+	/// One frame header byte (see `BINARY_FRAME_FLAG`), then the raw payload
+	Binary = 1,
+};
+
+/**
+ * The sources of indications we send to the host.
+ *
+ * The value is the channel number used in binary frame headers, and the
+ * index into `REPORT_ASCII_TAGS`.
+ */
+enum class Report : uint8_t
+{
+	Keyboard = 0,
+	Mouse = 1,
+	Joystick1 = 2,
+	Joystick2 = 3,
+	KeyPressed = 4,
+	KeyReleased = 5,
+	WriteDone = 6,
+};
+
+static const char REPORT_ASCII_TAGS[] = { 'k', 'm', 's', 't', 'p', 'r', 'a' };
+
+// Binary frame header is 1ccc_llll, where ccc is the `Report` channel and
+// llll is the payload length minus one. ASCII never sets the top bit, so the
+// host can tell binary frames and ASCII lines apart.
+static constexpr uint8_t BINARY_FRAME_FLAG = 0x80;
+static constexpr uint8_t BINARY_CHANNEL_SHIFT = 4;
+static constexpr uint8_t BINARY_MAX_PAYLOAD = 16;
+
+/// Room `formatReport` needs for the longest message (an ASCII line)
+static constexpr uint8_t REPORT_MAX_MESSAGE =
+    1 + ( 2 * BINARY_MAX_PAYLOAD ) + 1;
+
+/**
+ * Build an indication in `protocol`, returning the length. `out` needs room
+ * for `REPORT_MAX_MESSAGE` bytes.
+ */
+static uint8_t formatReport( HostProtocol protocol,
+                             Report source,
+                             const uint8_t* data,
+                             uint8_t data_len,
+                             char* out )
+{
+	uint8_t out_len = 0;
+	if ( protocol == HostProtocol::Binary )
+	{
+		assert( ( data_len > 0 ) && ( data_len <= BINARY_MAX_PAYLOAD ) );
+		out[out_len++] = BINARY_FRAME_FLAG |
+		                 ( (uint8_t)source << BINARY_CHANNEL_SHIFT ) |
+		                 ( data_len - 1 );
+		memcpy( &out[out_len], data, data_len );
+		out_len += data_len;
+	}
+	else
+	{
+		out[out_len++] = REPORT_ASCII_TAGS[(uint8_t)source];
+		for ( uint8_t i = 0; i < data_len; i++ )
+		{
+			hexEncode( data[i], &out[out_len] );
+			out_len += 2;
+		}
+		out[out_len++] = '\n';
+	}
+	return out_len;
+}
+
+/**
+ * Sends an indication to the host.
+ */
+typedef void ( *ReportSender )( Report source,
+                                const uint8_t* data,
+                                uint8_t data_len );
+
+/**
+ * Gathers PS/2 bytes from the keyboard and mouse into multi-byte
+ * indications, so a burst costs the host one line (or frame) rather than one
+ * per byte.
+ *
+ * One window is shared by both devices. It opens at the first byte after a
+ * flush, and isn't restarted by the bytes after it - so no byte waits longer
+ * than the window. A device whose batch fills up is sent early, and
+ * `flushAll` sends everything at once (say, before a decoded key, so the host
+ * sees bytes in the order they came off the wire).
+ */
+class ReportBatcher
+{
+   public:
+	/// Window value that turns batching off
+	static constexpr uint8_t DISABLED = 0xFF;
+
+	/**
+	 * Construct a new ReportBatcher object.
+	 *
+	 * @param send where full (or timed out) batches go
+	 */
+	ReportBatcher( ReportSender send )
+	    : m_send( send ),
+	      m_window_ms( DISABLED ),
+	      m_open( false ),
+	      m_opened( 0 )
+	{
+		memset( m_batches, 0, sizeof( m_batches ) );
+	}
+
+	/**
+	 * Change how long to gather bytes for, in milliseconds. Zero means until
+	 * the next `flushIfDue`. Anything gathered under the old setting is sent
+	 * first.
+	 */
+	void setWindow( uint8_t window_ms )
+	{
+		flushAll();
+		m_window_ms = window_ms;
+	}
+
+	uint8_t window() const { return m_window_ms; }
+
+	/**
+	 * Queue a byte from `Report::Keyboard` or `Report::Mouse`, received at
+	 * `now` (from `millis()`). With batching off, it's sent right away.
+	 */
+	void add( Report source, uint8_t value, unsigned long now )
+	{
+		assert( (uint8_t)source < NUM_BATCHES );
+		if ( m_window_ms == DISABLED )
+		{
+			m_send( source, &value, 1 );
+			return;
+		}
+		if ( !m_open )
+		{
+			m_open = true;
+			m_opened = now;
+		}
+		Batch& batch = m_batches[(uint8_t)source];
+		batch.data[batch.length++] = value;
+		if ( batch.length == BINARY_MAX_PAYLOAD )
+		{
+			// As big as a frame can get, so send it now
+			m_send( source, batch.data, batch.length );
+			batch.length = 0;
+		}
+	}
+
+	/**
+	 * Send everything gathered, if the window opened at least `window`
+	 * milliseconds before `now`.
+	 */
+	void flushIfDue( unsigned long now )
+	{
+		if ( m_open && ( ( now - m_opened ) >= m_window_ms ) )
+		{
+			flushAll();
+		}
+	}
+
+	/**
+	 * Send everything gathered, keyboard first, whether or not the window
+	 * has closed.
+	 */
+	void flushAll()
+	{
+		if ( !m_open )
+		{
+			return;
+		}
+		for ( uint8_t i = 0; i < NUM_BATCHES; i++ )
+		{
+			if ( m_batches[i].length != 0 )
+			{
+				m_send( (Report)i, m_batches[i].data, m_batches[i].length );
+				m_batches[i].length = 0;
+			}
+		}
+		m_open = false;
+	}
+
+	/**
+	 * Is anything waiting for the window to close?
+	 */
+	bool isOpen() const { return m_open; }
+
+	/**
+	 * How many bytes from `source` are waiting?
+	 */
+	uint8_t length( Report source ) const
+	{
+		return m_batches[(uint8_t)source].length;
+	}
+
+#ifndef TEST_MODE_NO_PRIVATE
+   private:
+#endif
+
+	/// One batch each for `Report::Keyboard` and `Report::Mouse`
+	static constexpr uint8_t NUM_BATCHES = 2;
+
+	struct Batch
+	{
+		uint8_t length;
+		uint8_t data[BINARY_MAX_PAYLOAD];
+	};
+
+	ReportSender m_send;
+	uint8_t m_window_ms;
+	bool m_open;
+	/// When the window opened, from `millis()`
+	unsigned long m_opened;
+	Batch m_batches[NUM_BATCHES];
+};
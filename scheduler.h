@@ -0,0 +1,92 @@
+/**
+ * Neotron-IO main loop scheduler.
+ *
+ * `loop()` is a table of tasks, run in order. Each task has a period, so
+ * work that doesn't need to happen on every pass (like the calibration
+ * report) can say so, and an `urgent` flag.
+ *
+ * While the `is_hot` function says a PS/2 transfer is in flight, only the
+ * urgent tasks run. The check is made again before every task, so once a
+ * device starts clocking, the most the PS/2 code ever waits is the length of
+ * the one non-urgent task that was already running. Everything else waits
+ * until the port is idle again - a byte takes about a millisecond, and the
+ * UART and joystick tick are both buffered by interrupts in the meantime.
+ *
+ * The table lives in flash.
+ *
+ * This project is also licensed under the GPL (v3 or later version, at your
+ * choice). See the [LICENCE](./LICENCE) file.
+ */
+
+#include "ticks.h"
+
+/**
+ * One entry in the task table.
+ */
+struct Task
+{
+	/// Called when the task is due
+	void ( *run )();
+	/// Ticks between runs, or zero to run on every pass
+	uint16_t period;
+	/// Keep running this while a PS/2 transfer is in flight?
+	bool urgent;
+};
+
+/**
+ * Runs a table of tasks, with urgent ones first in line.
+ */
+template <uint8_t NUM_TASKS>
+class Scheduler
+{
+   public:
+	/**
+	 * Construct a new Scheduler object.
+	 *
+	 * @param tasks the task table, in PROGMEM
+	 * @param is_hot says whether only urgent tasks should run
+	 */
+	Scheduler( const Task* tasks, bool ( *is_hot )() )
+	    : m_tasks( tasks ), m_is_hot( is_hot )
+	{
+		for ( uint8_t i = 0; i < NUM_TASKS; i++ )
+		{
+			m_last_run[i] = 0;
+		}
+	}
+
+	/**
+	 * Go through the table once, running whatever is due.
+	 */
+	void runPass()
+	{
+		for ( uint8_t i = 0; i < NUM_TASKS; i++ )
+		{
+			Task task;
+			memcpy_P( &task, &m_tasks[i], sizeof( task ) );
+			if ( !task.urgent && m_is_hot() )
+			{
+				continue;
+			}
+			if ( task.period != 0 )
+			{
+				uint16_t now = ticksNow();
+				if ( ( uint16_t )( now - m_last_run[i] ) < task.period )
+				{
+					continue;
+				}
+				m_last_run[i] = now;
+			}
+			task.run();
+		}
+	}
+
+#ifndef TEST_MODE_NO_PRIVATE
+   private:
+#endif
+
+	const Task* m_tasks;
+	bool ( *m_is_hot )();
+	/// When each periodic task last ran, in ticks
+	uint16_t m_last_run[NUM_TASKS];
+};
@@ -9,6 +9,11 @@
 #define fastDigitalRead digitalRead
 #define fastPinMode pinMode
 
+#define PROGMEM
+#define pgm_read_byte(addr) (*(const uint8_t *)(addr))
+#define memcpy_P memcpy
+#define strchr_P strchr
+
 int bitRead(int word, int bit);
 void digitalWrite(int pin, bool level);
 void pinMode(int pin, int mode);
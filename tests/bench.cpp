@@ -0,0 +1,592 @@
+/**
+ * Neotron-IO host-side benchmarks.
+ *
+ * Replays PS/2 and joystick traces through the same code the firmware runs,
+ * with `micros()` driven by the trace rather than the wall clock, so every
+ * run sees exactly the same edges at exactly the same (simulated) times. The
+ * real time each call takes is measured on the host and reported as a mean
+ * and a worst case.
+ *
+ * Host nanoseconds are not AVR cycles - compare runs against each other on
+ * the same machine, to spot a change that makes a path slower.
+ *
+ * Any files named on the command line are replayed too. Each is a log of
+ * what the firmware sent after an `L` command - the `w` lines of a line
+ * capture. Other lines are ignored, except that a line starting with `=`
+ * lists the bytes (in hex) the capture should decode to, so a waveform from
+ * a real device can be kept as a regression test.
+ */
+
+#define TEST_MODE_NO_PRIVATE
+
+#include <cctype>
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <ctime>
+#include <vector>
+
+#include "arduino_stubs.h"
+
+#include "RingBuf.h"
+#include "capture.h"
+#include "command.h"
+#include "hex.h"
+#include "joystick.h"
+#include "ps2.h"
+#include "ps2bus.h"
+
+#define MAX_PINS 8
+static int pin_levels[MAX_PINS];
+static unsigned long sim_now_us;
+
+/// Simulated time between two passes of `loop()`
+static const unsigned long LOOP_STEP_US = 5;
+
+/// Time for one PS/2 clock phase (so 12.5 kHz)
+static const unsigned long PS2_HALF_CLOCK_US = 40;
+
+/// Time from a data change to the falling clock edge
+static const unsigned long PS2_SETUP_US = 15;
+
+/// Idle time between two PS/2 bytes
+static const unsigned long PS2_BYTE_GAP_US = 500;
+
+/// One edge on a PS/2 channel
+struct Edge
+{
+	unsigned long time_us;
+	int pin;
+	int level;
+};
+
+/// Cost of one path, in host nanoseconds
+struct Stats
+{
+	const char *name;
+	unsigned long calls;
+	uint64_t total_ns;
+	uint64_t worst_ns;
+};
+
+static uint64_t now_ns()
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+template <typename F>
+static void timed(Stats &stats, F fn)
+{
+	uint64_t start = now_ns();
+	fn();
+	uint64_t taken = now_ns() - start;
+	stats.calls++;
+	stats.total_ns += taken;
+	if (taken > stats.worst_ns)
+	{
+		stats.worst_ns = taken;
+	}
+}
+
+static void print_stats(const Stats &stats)
+{
+	printf("%-24s %10lu %10.1f %10llu\n", stats.name, stats.calls,
+	       stats.calls ? (double)stats.total_ns / stats.calls : 0.0,
+	       (unsigned long long)stats.worst_ns);
+}
+
+/**
+ * Add the edges for a device sending some bytes, starting at `start_us`.
+ *
+ * @return when the last byte has finished
+ */
+static unsigned long add_ps2_bytes(std::vector<Edge> &edges, int clk_pin,
+                                   int dat_pin, unsigned long start_us,
+                                   const uint8_t *data, size_t data_len)
+{
+	unsigned long t = start_us;
+	for (size_t i = 0; i < data_len; i++)
+	{
+		uint16_t word = Ps2<0, 1>::encodeByte(data[i]);
+		for (int bit = 0; bit < 11; bit++)
+		{
+			edges.push_back({t, dat_pin, (word >> bit) & 1});
+			t += PS2_SETUP_US;
+			edges.push_back({t, clk_pin, 0});
+			t += PS2_HALF_CLOCK_US;
+			edges.push_back({t, clk_pin, 1});
+			t += PS2_HALF_CLOCK_US - PS2_SETUP_US;
+		}
+		edges.push_back({t, dat_pin, 1});
+		t += PS2_BYTE_GAP_US;
+	}
+	return t;
+}
+
+static void sort_edges(std::vector<Edge> &edges)
+{
+	// Stable, so edges at the same time stay in order
+	for (size_t i = 1; i < edges.size(); i++)
+	{
+		Edge e = edges[i];
+		size_t j = i;
+		while ((j > 0) && (edges[j - 1].time_us > e.time_us))
+		{
+			edges[j] = edges[j - 1];
+			j--;
+		}
+		edges[j] = e;
+	}
+}
+
+static void idle_pins()
+{
+	for (int i = 0; i < MAX_PINS; i++)
+	{
+		pin_levels[i] = 1;
+	}
+}
+
+// Someone typing "neotron" - Scan Code Set 2 makes and breaks
+static const uint8_t KEYBOARD_TRACE[] = {
+	0x31, 0xF0, 0x31, 0x24, 0xF0, 0x24, 0x44, 0xF0, 0x44, 0x2C,
+	0xF0, 0x2C, 0x2D, 0xF0, 0x2D, 0x44, 0xF0, 0x44, 0x31, 0xF0,
+	0x31,
+};
+
+// A mouse moving right and down, with a click part way through
+static const uint8_t MOUSE_TRACE[] = {
+	0x08, 0x01, 0xFF, 0x08, 0x02, 0xFE, 0x09, 0x00, 0x00,
+	0x09, 0x01, 0xFF, 0x08, 0x00, 0x00, 0x08, 0x03, 0xFD,
+};
+
+/**
+ * Play some edges on pins 0 (CLK) and 1 (DAT), with `Ps2::poll` looking
+ * for them, and collect what it decodes.
+ */
+static void replay_polled(const std::vector<Edge> &edges, unsigned long end,
+                          Stats &stats, std::vector<uint8_t> &received)
+{
+	Ps2<0, 1> ps2;
+	idle_pins();
+	size_t next = 0;
+	for (sim_now_us = 0; sim_now_us < end; sim_now_us += LOOP_STEP_US)
+	{
+		while ((next < edges.size()) && (edges[next].time_us <= sim_now_us))
+		{
+			pin_levels[edges[next].pin] = edges[next].level;
+			next++;
+		}
+		timed(stats, [&] { ps2.poll(); });
+		int b;
+		while ((b = ps2.readBuffer()) >= 0)
+		{
+			received.push_back(b);
+		}
+	}
+}
+
+static bool matches(const std::vector<uint8_t> &received, const uint8_t *want,
+                    size_t want_len)
+{
+	return (received.size() == want_len) &&
+	       (memcmp(received.data(), want, want_len) == 0);
+}
+
+/**
+ * Keyboard on its own, with `Ps2::poll` looking for the edges. The worst
+ * poll is how late the next edge can be noticed.
+ */
+static bool bench_ps2_polled(Stats &stats)
+{
+	std::vector<Edge> edges;
+	unsigned long end = add_ps2_bytes(edges, 0, 1, 100, KEYBOARD_TRACE,
+	                                  sizeof(KEYBOARD_TRACE));
+	std::vector<uint8_t> received;
+	replay_polled(edges, end, stats, received);
+	return matches(received, KEYBOARD_TRACE, sizeof(KEYBOARD_TRACE));
+}
+
+/**
+ * Turn the runs of a line capture back into edges on pins 0 (CLK) and
+ * 1 (DAT), starting at `start_us`. Ticks are microseconds, as at 8 MHz.
+ *
+ * @return when the last run ends
+ */
+static unsigned long add_capture_runs(std::vector<Edge> &edges,
+                                      unsigned long start_us,
+                                      const std::vector<uint16_t> &runs)
+{
+	typedef LineCapture<1> Capture;
+	unsigned long t = start_us;
+	for (size_t i = 0; i < runs.size(); i++)
+	{
+		uint8_t lines = runs[i] >> Capture::LINES_SHIFT;
+		edges.push_back({t, 0, (lines & Capture::LINE_CLK) ? 1 : 0});
+		edges.push_back({t, 1, (lines & Capture::LINE_DAT) ? 1 : 0});
+		t += runs[i] & Capture::MAX_RUN;
+	}
+	return t;
+}
+
+/**
+ * Capture the start of the keyboard trace, sampling once per loop step as
+ * `taskCaptureSample` would, then replay the capture. It should decode to
+ * the same bytes.
+ */
+static bool bench_capture(Stats &sample_stats, Stats &replay_stats)
+{
+	static const size_t NUM_BYTES = 3;
+	std::vector<Edge> edges;
+	unsigned long end =
+	    add_ps2_bytes(edges, 0, 1, 100, KEYBOARD_TRACE, NUM_BYTES);
+	// Leave time for the capture to see the lines go quiet
+	end += LineCapture<1>::MAX_RUN + LOOP_STEP_US;
+
+	LineCapture<128> capture;
+	capture.arm();
+	idle_pins();
+	size_t next = 0;
+	for (sim_now_us = 0; sim_now_us < end; sim_now_us += LOOP_STEP_US)
+	{
+		while ((next < edges.size()) && (edges[next].time_us <= sim_now_us))
+		{
+			pin_levels[edges[next].pin] = edges[next].level;
+			next++;
+		}
+		uint8_t lines = (pin_levels[0] ? capture.LINE_CLK : 0) |
+		                (pin_levels[1] ? capture.LINE_DAT : 0);
+		timed(sample_stats, [&] { capture.sample(lines, sim_now_us); });
+	}
+
+	std::vector<uint16_t> runs;
+	uint16_t chunk[8];
+	uint8_t count;
+	while ((count = capture.read(chunk, 8)) != 0)
+	{
+		runs.insert(runs.end(), chunk, chunk + count);
+	}
+	std::vector<Edge> replay;
+	unsigned long replay_end = add_capture_runs(replay, 100, runs);
+	std::vector<uint8_t> received;
+	replay_polled(replay, replay_end, replay_stats, received);
+	return matches(received, KEYBOARD_TRACE, NUM_BYTES);
+}
+
+/**
+ * Read the hex bytes (or 16-bit words, if `word` is set) from a line.
+ */
+static void parse_hex(const char *p, bool word, std::vector<uint16_t> &out)
+{
+	const size_t digits = word ? 4 : 2;
+	while (true)
+	{
+		while (*p == ' ')
+		{
+			p++;
+		}
+		uint16_t value = 0;
+		size_t n;
+		for (n = 0; n < digits; n++)
+		{
+			uint8_t nibble = hexDecode(p[n]);
+			if (nibble == HEX_INVALID)
+			{
+				break;
+			}
+			value = (value << 4) | nibble;
+		}
+		if (n != digits)
+		{
+			return;
+		}
+		out.push_back(value);
+		p += digits;
+	}
+}
+
+/**
+ * Replay a line capture the firmware sent, from a file.
+ */
+static bool bench_capture_file(const char *path, Stats &stats)
+{
+	FILE *f = fopen(path, "r");
+	if (!f)
+	{
+		printf("%s: can't open\n", path);
+		return false;
+	}
+	std::vector<uint16_t> runs;
+	std::vector<uint16_t> want;
+	bool has_want = false;
+	char line[256];
+	while (fgets(line, sizeof(line), f))
+	{
+		if (line[0] == 'w')
+		{
+			parse_hex(&line[1], true, runs);
+		}
+		else if (line[0] == '=')
+		{
+			parse_hex(&line[1], false, want);
+			has_want = true;
+		}
+	}
+	fclose(f);
+
+	std::vector<Edge> edges;
+	unsigned long end = add_capture_runs(edges, 100, runs);
+	std::vector<uint8_t> received;
+	replay_polled(edges, end, stats, received);
+	printf("%s: %zu runs, %lu us, decoded", path, runs.size(), end);
+	for (size_t i = 0; i < received.size(); i++)
+	{
+		printf(" %02X", received[i]);
+	}
+	printf("\n");
+
+	bool pass = !has_want || (received.size() == want.size());
+	for (size_t i = 0; pass && (i < received.size()); i++)
+	{
+		pass = (received[i] == want[i]);
+	}
+	if (!pass)
+	{
+		printf("%s: expected other bytes\n", path);
+	}
+	return pass;
+}
+
+/**
+ * Keyboard and mouse at the same time, through the `Ps2Bus`. Each edge is
+ * handed to `onPinChange`, as the PCINT1 interrupt would, and the worst of
+ * those is the edge-service latency.
+ */
+static bool bench_ps2_bus(Stats &isr_stats, Stats &poll_stats)
+{
+	std::vector<Edge> edges;
+	unsigned long kb_end = add_ps2_bytes(edges, 0, 1, 100, KEYBOARD_TRACE,
+	                                     sizeof(KEYBOARD_TRACE));
+	// Start the mouse part way through a keyboard bit
+	unsigned long ms_end = add_ps2_bytes(edges, 2, 3, 130, MOUSE_TRACE,
+	                                     sizeof(MOUSE_TRACE));
+	sort_edges(edges);
+	unsigned long end = (kb_end > ms_end) ? kb_end : ms_end;
+
+	Ps2<0, 1, true> keyboard;
+	Ps2<2, 3, true> mouse;
+	Ps2Bus<Ps2<0, 1, true>, Ps2<2, 3, true>, true> bus(keyboard, mouse);
+	idle_pins();
+	size_t next = 0;
+	size_t kb_received = 0;
+	size_t ms_received = 0;
+	bool pass = true;
+	for (sim_now_us = 0; sim_now_us < end; sim_now_us += LOOP_STEP_US)
+	{
+		while ((next < edges.size()) && (edges[next].time_us <= sim_now_us))
+		{
+			pin_levels[edges[next].pin] = edges[next].level;
+			if ((edges[next].pin & 1) == 0)
+			{
+				timed(isr_stats, [&] { bus.onPinChange(); });
+			}
+			next++;
+		}
+		timed(poll_stats, [&] { bus.poll(); });
+		int b;
+		while ((b = keyboard.readBuffer()) >= 0)
+		{
+			pass &= (kb_received < sizeof(KEYBOARD_TRACE)) &&
+			        (b == KEYBOARD_TRACE[kb_received]);
+			kb_received++;
+		}
+		while ((b = mouse.readBuffer()) >= 0)
+		{
+			pass &= (ms_received < sizeof(MOUSE_TRACE)) &&
+			        (b == MOUSE_TRACE[ms_received]);
+			ms_received++;
+		}
+	}
+	return pass && (kb_received == sizeof(KEYBOARD_TRACE)) &&
+	       (ms_received == sizeof(MOUSE_TRACE));
+}
+
+/**
+ * An Atari-style pad sampled at 1 kHz with debounce on. The A button goes
+ * down and up every 50 ms, with a sample of contact bounce either side.
+ */
+static bool bench_joystick(Stats &stats)
+{
+	// Up, down, left, right, A/B, start/C, select
+	Joystick<0, 1, 2, 3, 4, 5, 6> js;
+	js.setDebounce(4);
+	idle_pins();
+	unsigned long reports = 0;
+	const unsigned long TOGGLES = 40;
+	for (unsigned long ms = 0; ms < (TOGGLES + 1) * 50; ms++)
+	{
+		sim_now_us = ms * 1000;
+		unsigned long phase = ms % 50;
+		bool pressed = ((ms / 50) & 1) != 0;
+		if ((phase == 1) || (phase == 3))
+		{
+			// Bounce
+			pressed = !pressed;
+		}
+		pin_levels[4] = pressed ? 0 : 1;
+		bool changed = false;
+		timed(stats, [&] { changed = js.scan(); });
+		if (changed)
+		{
+			js.read();
+			reports++;
+		}
+	}
+	return reports == TOGGLES;
+}
+
+/**
+ * Parse full-length `K` commands a character at a time, as the RX interrupt
+ * does, and take them out of the queue as `loop()` does. The worst character
+ * is the longest the RX interrupt spends parsing.
+ */
+static bool bench_command_parser(Stats &stats)
+{
+	static const char line[] = "KED02F4F3000102030405060708090A0B\n";
+	SpscRingBuf<HostCommand, 4> queue;
+	CommandParser<SpscRingBuf<HostCommand, 4>> parser(queue, HOST_COMMANDS);
+	bool pass = true;
+	for (int i = 0; i < 10000; i++)
+	{
+		for (size_t n = 0; n < sizeof(line) - 1; n++)
+		{
+			timed(stats, [&] { parser.push(line[n]); });
+		}
+		HostCommand command;
+		pass &= queue.pop(command) && (command.command == 'K') &&
+		        (command.length == 16) && (command.data[0] == 0xED) &&
+		        (command.data[15] == 0x0B);
+	}
+	return pass && (parser.dropped() == 0);
+}
+
+/**
+ * Build a 16-byte ASCII indication and put it in the transmit buffer, as
+ * `reportBytes` does, then empty the buffer as the UDRE interrupt would.
+ */
+static bool bench_report_line(Stats &report_stats, Stats &drain_stats)
+{
+	SpscRingBuf<char, 256> tx;
+	uint8_t data[16];
+	for (size_t i = 0; i < sizeof(data); i++)
+	{
+		data[i] = i * 17;
+	}
+	bool pass = true;
+	for (int i = 0; i < 10000; i++)
+	{
+		timed(report_stats, [&] {
+			char line[2 + (sizeof(data) * 2) + 2];
+			size_t len = 0;
+			line[len++] = 'k';
+			for (size_t n = 0; n < sizeof(data); n++)
+			{
+				hexEncode(data[n], &line[len]);
+				len += 2;
+			}
+			line[len++] = '\r';
+			line[len++] = '\n';
+			pass &= (tx.pushN(line, len) == len);
+		});
+		timed(drain_stats, [&] {
+			typename SpscRingBuf<char, 256>::Span span;
+			while ((span = tx.contiguousReadable()).length != 0)
+			{
+				tx.consume(span.length);
+			}
+		});
+	}
+	return pass;
+}
+
+int main(int argc, char **argv)
+{
+	Stats ps2_polled = {"Ps2::poll (polled)", 0, 0, 0};
+	Stats bus_isr = {"Ps2Bus::onPinChange", 0, 0, 0};
+	Stats bus_poll = {"Ps2Bus::poll", 0, 0, 0};
+	Stats js_scan = {"Joystick::scan", 0, 0, 0};
+	Stats parse = {"CommandParser::push", 0, 0, 0};
+	Stats report_line = {"report line (16 bytes)", 0, 0, 0};
+	Stats drain = {"UDRE drain", 0, 0, 0};
+	Stats capture_sample = {"LineCapture::sample", 0, 0, 0};
+	Stats capture_replay = {"Ps2::poll (capture)", 0, 0, 0};
+	Stats file_replay = {"Ps2::poll (files)", 0, 0, 0};
+
+	bool pass = true;
+	pass &= bench_ps2_polled(ps2_polled);
+	pass &= bench_ps2_bus(bus_isr, bus_poll);
+	pass &= bench_joystick(js_scan);
+	pass &= bench_command_parser(parse);
+	pass &= bench_report_line(report_line, drain);
+	pass &= bench_capture(capture_sample, capture_replay);
+	for (int i = 1; i < argc; i++)
+	{
+		pass &= bench_capture_file(argv[i], file_replay);
+	}
+
+	printf("%-24s %10s %10s %10s\n", "path", "calls", "mean ns", "worst ns");
+	print_stats(ps2_polled);
+	print_stats(bus_isr);
+	print_stats(bus_poll);
+	print_stats(js_scan);
+	print_stats(parse);
+	print_stats(report_line);
+	print_stats(drain);
+	print_stats(capture_sample);
+	print_stats(capture_replay);
+	if (argc > 1)
+	{
+		print_stats(file_replay);
+	}
+	printf("\nWorst edge-service latency: %llu ns (interrupt), %llu ns "
+	       "(polled)\n",
+	       (unsigned long long)bus_isr.worst_ns,
+	       (unsigned long long)ps2_polled.worst_ns);
+	printf("PS/2 edge budget: %lu us\n", PS2_HALF_CLOCK_US - PS2_SETUP_US);
+
+	if (!pass)
+	{
+		printf("A replay did not decode what it sent!\n");
+		return 1;
+	}
+	return 0;
+}
+
+int bitRead(int word, int bit)
+{
+	return ((word & (1 << bit)) != 0) ? 1 : 0;
+}
+
+void digitalWrite(int pin, bool level)
+{
+	if ((pin >= 0) && (pin < MAX_PINS))
+	{
+		pin_levels[pin] = level;
+	}
+}
+
+void pinMode(int pin, int mode)
+{
+}
+
+int digitalRead(int pin)
+{
+	return pin_levels[pin];
+}
+
+unsigned long micros()
+{
+	return sim_now_us;
+}
@@ -11,10 +11,25 @@
 #include "arduino_stubs.h"
 
 #include "ps2.h"
+#include "ps2bus.h"
+#include "mouse.h"
+#include "keyboard.h"
+#include "joystick.h"
+#include "command.h"
+#include "hex.h"
+#include "scheduler.h"
+#include "output.h"
+#include "capture.h"
+#include "config.h"
+#include "report.h"
 
-#define MAX_PINS 4
+#define MAX_PINS 8
 int pin_results[MAX_PINS];
 
+// If set, pin reads and writes go to a model of whatever is attached
+static int (*pin_read_hook)(int pin);
+static void (*pin_write_hook)(int pin, bool level);
+
 typedef bool (*test_fn_t)(const char **sz_name);
 
 #define DEFINE_TEST(test_name)                  \
@@ -75,6 +90,164 @@ DEFINE_TEST(ps2_collect_bits)
 	return (read_byte == 0xAA);
 }
 
+// Check PS/2 can collect bits from the pin-change interrupt
+DEFINE_TEST(ps2_isr_collect_bits)
+{
+	// 0 is clk, 1 = data
+	Ps2<0, 1, true> ps2;
+	uint16_t test_word = (0x03 << 9) | (0x55 << 1);
+	for (int i = 0; i < 11; i++)
+	{
+		pin_results[0] = 1;
+		ps2.onPinChange();
+		// Polling must not clock in any bits itself
+		ps2.poll();
+		pin_results[1] = (test_word & (1 << i)) ? 1 : 0;
+		pin_results[0] = 0;
+		ps2.onPinChange();
+		ps2.poll();
+	}
+
+	int read_byte = ps2.readBuffer();
+	// Should have collected 0x55, and nothing else
+	return (read_byte == 0x55) && (ps2.readBuffer() == -1);
+}
+
+// Clock a whole byte in from the device, as if we were the ISR
+template <typename PS2>
+static void ps2_answer(PS2& ps2, uint8_t b)
+{
+	uint16_t word = PS2::encodeByte(b);
+	for (int i = 0; i < 11; i++)
+	{
+		ps2.clockInBit((word >> i) & 1);
+	}
+}
+
+// Check a write is sent again on Resend, and completes once ACKed
+DEFINE_TEST(ps2_write_resend)
+{
+	Ps2<0, 1, true> ps2;
+	const uint8_t cmd[] = {0xED, 0x02};
+	Ps2WriteResult result;
+	bool pass = ps2.writeBuffer(cmd, sizeof(cmd));
+	// The keyboard asks for the first byte again - that's not passed up
+	ps2.onByteSent();
+	ps2_answer(ps2, 0xFE);
+	ps2.poll();
+	pass &= (ps2.m_out_buffer.size() == 2) && (ps2.readBuffer() == -1);
+	// This time it's ACKed
+	ps2.onByteSent();
+	ps2_answer(ps2, 0xFA);
+	ps2.poll();
+	pass &= (ps2.m_out_buffer.size() == 1) && (ps2.readBuffer() == 0xFA);
+	pass &= !ps2.readCompletion(result);
+	ps2.onByteSent();
+	ps2_answer(ps2, 0xFA);
+	ps2.poll();
+	pass &= ps2.readCompletion(result) && (result == Ps2WriteResult::Ok);
+	pass &= ps2.m_out_buffer.isEmpty();
+	// Three resends in a row drop the whole transaction
+	pass &= ps2.writeBuffer(cmd, sizeof(cmd));
+	for (int i = 0; i < 3; i++)
+	{
+		ps2.onByteSent();
+		ps2_answer(ps2, 0xFE);
+		ps2.poll();
+	}
+	pass &= ps2.readCompletion(result) &&
+	        (result == Ps2WriteResult::TooManyResends);
+	pass &= ps2.m_out_buffer.isEmpty();
+	// No answer at all
+	pass &= ps2.writeBuffer(cmd, 1);
+	ps2.onByteSent();
+	ps2.m_response_started -= 20000;
+	ps2.poll();
+	pass &= ps2.readCompletion(result) &&
+	        (result == Ps2WriteResult::NoResponse);
+	return pass;
+}
+
+// Check the clock is held off at the high watermark, until the low one
+DEFINE_TEST(ps2_watermarks)
+{
+	Ps2<0, 1, true, 4, 2> ps2;
+	bool pass = true;
+	for (int i = 0; i < 4; i++)
+	{
+		pass &= (ps2.m_state == Ps2State::Idle);
+		ps2_answer(ps2, 0x10 + i);
+	}
+	pass &= (ps2.m_state == Ps2State::BufferFull);
+	pass &= (ps2.readBuffer() == 0x10);
+	pass &= (ps2.m_state == Ps2State::BufferFull);
+	pass &= (ps2.readBuffer() == 0x11);
+	pass &= (ps2.m_state == Ps2State::Idle);
+	pass &= (ps2.readBuffer() == 0x12) && (ps2.readBuffer() == 0x13);
+	return pass;
+}
+
+// Check bad words and a full buffer are counted
+DEFINE_TEST(ps2_counters)
+{
+	Ps2<0, 1, true, 4, 2> ps2;
+	uint16_t bad_parity = Ps2<0, 1>::encodeByte(0x1C) ^ (1 << 9);
+	for (int i = 0; i < 11; i++)
+	{
+		ps2.clockInBit((bad_parity >> i) & 1);
+	}
+	bool pass = (ps2.readBuffer() == -1);
+	pass &= (ps2.counters().word_errors == 1);
+	for (int i = 0; i < 4; i++)
+	{
+		ps2_answer(ps2, 0x1C);
+	}
+	pass &= (ps2.m_state == Ps2State::BufferFull);
+	pass &= (ps2.counters().buffer_full == 1);
+	ps2.clearCounters();
+	pass &= (ps2.counters().word_errors == 0) &&
+	        (ps2.counters().buffer_full == 0);
+	return pass;
+}
+
+// Check a port only says it's quiet with nothing left to do
+DEFINE_TEST(ps2_quiet)
+{
+	Ps2<0, 1, true> ps2;
+	bool pass = ps2.isQuiet();
+	ps2_answer(ps2, 0xAA);
+	pass &= !ps2.isQuiet();
+	pass &= (ps2.readBuffer() == 0xAA) && ps2.isQuiet();
+	const uint8_t cmd[] = {0xFF};
+	ps2.writeBuffer(cmd, sizeof(cmd));
+	pass &= !ps2.isQuiet();
+	return pass;
+}
+
+// Check one bus sample clocks bits into the right port, and only that one
+DEFINE_TEST(ps2_bus)
+{
+	Ps2<0, 1, true> ps2_a;
+	Ps2<2, 3, true> ps2_b;
+	Ps2Bus<Ps2<0, 1, true>, Ps2<2, 3, true>, false> bus(ps2_a, ps2_b);
+	for (int i = 0; i < MAX_PINS; i++)
+	{
+		pin_results[i] = 1;
+	}
+	uint16_t test_word = Ps2<0, 1>::encodeByte(0x5A);
+	for (int i = 0; i < 11; i++)
+	{
+		pin_results[1] = (test_word >> i) & 1;
+		pin_results[0] = 0;
+		bus.poll();
+		pin_results[0] = 1;
+		bus.poll();
+	}
+	bool pass = (ps2_a.readBuffer() == 0x5A) && (ps2_b.readBuffer() == -1);
+	pass &= (ps2_b.m_state == Ps2State::Idle);
+	return pass;
+}
+
 DEFINE_TEST(ps2_validate_words)
 {
 	const int inputs[] = {0x600, 0x606, 0x402};
@@ -88,6 +261,30 @@ DEFINE_TEST(ps2_validate_words)
 	return pass;
 }
 
+// Check any single wrong bit in any word is caught, and the parity fold
+// agrees with counting
+DEFINE_TEST(ps2_bad_words)
+{
+	static_assert(Ps2<0, 1>::encodeByte(0x00) == 0x600,
+	              "encodeByte should work at compile time");
+	bool pass = true;
+	for (int i = 0; i < 256; i++)
+	{
+		int ones = 0;
+		for (int bit = 0; bit < 8; bit++)
+		{
+			ones += (i >> bit) & 1;
+		}
+		pass &= (Ps2<0, 1>::oddParity(i) == (ones & 1));
+		uint16_t word = Ps2<0, 1>::encodeByte(i);
+		for (int bit = 0; bit < 11; bit++)
+		{
+			pass &= (Ps2<0, 1>::validateWord(word ^ (1 << bit)) == -1);
+		}
+	}
+	return pass;
+}
+
 DEFINE_TEST(ps2_encode_bytes)
 {
 	bool pass = true;
@@ -103,6 +300,753 @@ DEFINE_TEST(ps2_encode_bytes)
 	return pass;
 }
 
+// Check the in-place read span stops at the end of the storage
+DEFINE_TEST(ringbuf_read_span)
+{
+	RingBuf<char, 8> buf;
+	for (int i = 0; i < 6; i++)
+	{
+		buf.push('a' + i);
+	}
+	buf.consume(5);
+	for (int i = 0; i < 4; i++)
+	{
+		buf.push('A' + i);
+	}
+	// Holds "fABCD", with "fAB" before the wrap
+	RingBuf<char, 8>::Span span = buf.contiguousReadable();
+	bool pass = (span.length == 3) && (span.data[0] == 'f') &&
+	            (span.data[2] == 'B');
+	buf.consume(span.length);
+	span = buf.contiguousReadable();
+	pass &= (span.length == 2) && (span.data[0] == 'C');
+	buf.consume(span.length);
+	pass &= buf.isEmpty() && (buf.contiguousReadable().length == 0);
+	return pass;
+}
+
+// Check the lock-free buffer wraps, and keeps one slot free
+DEFINE_TEST(ringbuf_spsc)
+{
+	SpscRingBuf<char, 8> buf;
+	bool pass = buf.isEmpty() && (buf.maxSize() == 7);
+	for (int i = 0; i < 7; i++)
+	{
+		pass &= buf.push('a' + i);
+	}
+	pass &= buf.isFull() && !buf.push('x') && (buf.size() == 7);
+	char c = 0;
+	for (int i = 0; i < 5; i++)
+	{
+		pass &= buf.pop(c) && (c == 'a' + i);
+	}
+	for (int i = 0; i < 4; i++)
+	{
+		pass &= buf.push('A' + i);
+	}
+	// Holds "fgABCD", with "fgA" before the wrap
+	SpscRingBuf<char, 8>::Span span = buf.contiguousReadable();
+	pass &= (buf.size() == 6) && (span.length == 3) && (span.data[0] == 'f');
+	buf.consume(span.length);
+	pass &= buf.pop(c) && (c == 'B') && (buf.size() == 2);
+	buf.consume(10);
+	pass &= buf.isEmpty() && !buf.pop(c);
+	return pass;
+}
+
+// Check blocks go in and out across the wrap, and stop when full or empty
+DEFINE_TEST(ringbuf_bulk)
+{
+	RingBuf<char, 8> buf;
+	SpscRingBuf<char, 8> spsc;
+	char out[10];
+	bool pass = (buf.pushN("abcdef", 6) == 6) && (spsc.pushN("abcdef", 6) == 6);
+	pass &= (buf.popN(out, 5) == 5) && (memcmp(out, "abcde", 5) == 0);
+	pass &= (spsc.popN(out, 5) == 5) && (memcmp(out, "abcde", 5) == 0);
+	// Only 7 and 6 more fit, wrapping round
+	pass &= (buf.pushN("ABCDEFGHIJ", 10) == 7) && buf.isFull();
+	pass &= (spsc.pushN("ABCDEFGHIJ", 10) == 6) && spsc.isFull();
+	pass &= (buf.popN(out, 10) == 8) && (memcmp(out, "fABCDEFG", 8) == 0);
+	pass &= (spsc.popN(out, 10) == 7) && (memcmp(out, "fABCDEF", 7) == 0);
+	pass &= buf.isEmpty() && spsc.isEmpty();
+	// Write in place - both are now empty with the indices part way round
+	RingBuf<char, 8>::Span span = buf.contiguousWritable();
+	pass &= (span.length == 3);
+	span.data[0] = 'x';
+	buf.commit(1);
+	SpscRingBuf<char, 8>::Span spsc_span = spsc.contiguousWritable();
+	pass &= (spsc_span.length == 4);
+	spsc_span.data[0] = 'y';
+	spsc.commit(1);
+	pass &= buf.pop(out[0]) && (out[0] == 'x');
+	pass &= spsc.pop(out[0]) && (out[0] == 'y');
+	return pass;
+}
+
+// Somewhere for `HostOutput` to put things, with room for `space` bytes
+struct FakeUart
+{
+	size_t space;
+	char sent[64];
+	size_t sent_len;
+
+	size_t spaceAvailable() { return space; }
+	size_t write(const char *data, size_t data_len)
+	{
+		memcpy(&sent[sent_len], data, data_len);
+		sent_len += data_len;
+		space -= data_len;
+		return data_len;
+	}
+};
+
+// Build joystick messages like the firmware's ASCII protocol
+static uint8_t format_test_joystick(uint8_t joystick, uint16_t state, char *out)
+{
+	out[0] = (joystick == 0) ? 's' : 't';
+	hexEncode(state >> 8, &out[1]);
+	hexEncode(state & 0xFF, &out[3]);
+	out[5] = '\n';
+	return 6;
+}
+
+// Check the output arbiter sends whole messages, urgent ones first, and
+// only sends the latest joystick state
+DEFINE_TEST(output_priority)
+{
+	FakeUart uart = {};
+	HostOutput<FakeUart, 16, 8> output(uart, format_test_joystick);
+	bool pass = true;
+	pass &= output.send(OutputLane::Mouse, "m01\n", 4);
+	output.setJoystick(0, 0x0001);
+	output.setJoystick(0, 0x0002);
+	pass &= output.send(OutputLane::Urgent, "k1C\n", 4);
+	// No room for another mouse message
+	pass &= !output.send(OutputLane::Mouse, "m02\n", 4);
+	pass &= (output.dropped() == 4);
+	// Room for the keyboard, but not the joystick - so the mouse waits too
+	uart.space = 8;
+	output.poll();
+	pass &= (uart.sent_len == 4) && (memcmp(uart.sent, "k1C\n", 4) == 0);
+	// It changes again while it waits
+	output.setJoystick(0, 0x0042);
+	uart.space = 20;
+	output.poll();
+	pass &= (uart.sent_len == 14) && output.isEmpty();
+	pass &= (memcmp(uart.sent, "k1C\ns0042\nm01\n", 14) == 0);
+	return pass;
+}
+
+// Check movement packets can't fill the mouse lane so far that a command's
+// ACK and write-done get dropped
+DEFINE_TEST(output_mouse_reserve)
+{
+	FakeUart uart = {};
+	HostOutput<FakeUart, 16, 64, 12> output(uart, format_test_joystick);
+	bool pass = true;
+	size_t packets = 0;
+	while (output.mousePacketSpace() >= 10)
+	{
+		pass &= output.send(OutputLane::Mouse, "m08010203\n", 10);
+		packets++;
+	}
+	pass &= (packets != 0);
+	pass &= output.send(OutputLane::Mouse, "mFA\n", 4);
+	pass &= output.send(OutputLane::Mouse, "a0100\n", 6);
+	pass &= (output.dropped() == 0);
+	uart.space = sizeof(uart.sent);
+	output.poll();
+	pass &= (uart.sent_len == (packets * 10) + 10) && output.isEmpty();
+	pass &= (memcmp(&uart.sent[packets * 10], "mFA\na0100\n", 10) == 0);
+	return pass;
+}
+
+// Check a line capture waits for the first edge, records runs and stops
+// once the lines have been idle for long enough
+DEFINE_TEST(capture_runs)
+{
+	LineCapture<8> capture;
+	const uint8_t IDLE = capture.LINE_CLK | capture.LINE_DAT;
+	bool pass = true;
+	capture.arm();
+	pass &= !capture.sample(IDLE, 100);
+	pass &= (capture.state() == CaptureState::Armed);
+	// Start bit, then the clock falls 15 ticks later
+	pass &= !capture.sample(capture.LINE_CLK, 200);
+	pass &= (capture.state() == CaptureState::Capturing);
+	pass &= !capture.sample(0, 215);
+	pass &= !capture.sample(capture.LINE_CLK, 255);
+	pass &= !capture.sample(IDLE, 280);
+	// Quiet for long enough - done
+	pass &= !capture.sample(IDLE, 280 + capture.MAX_RUN - 1);
+	pass &= capture.sample(IDLE, 280 + capture.MAX_RUN);
+	uint16_t runs[8];
+	pass &= (capture.read(runs, 8) == 4);
+	pass &= (runs[0] == 0x800F) && (runs[1] == 0x0028) && (runs[2] == 0x8019);
+	pass &= (runs[3] == 0xFFFF);
+	pass &= (capture.read(runs, 8) == 0);
+	// A long run is split, and a full buffer stops the capture
+	LineCapture<4> small;
+	small.arm();
+	small.sample(0, 0);
+	pass &= small.sample(IDLE, 0xFFFE);
+	pass &= (small.read(runs, 8) == 4);
+	pass &= (runs[0] == 0x3FFF) && (runs[3] == 0x3FFF);
+	pass &= (small.read(runs, 8) == 0);
+	return pass;
+}
+
+// Check the config block survives a trip through EEPROM, spots corruption,
+// and that fields are read and written as the `E` command expects
+DEFINE_TEST(config_block)
+{
+	Config config = {};
+	bool pass = true;
+	const uint8_t baud[] = {0x02};
+	const uint8_t mouse_init[] = {0x02, 0xFF, 0xF4};
+	pass &= configSetField(config, (uint8_t)ConfigField::BaudIndex, baud, 1);
+	pass &= configSetField(config, (uint8_t)ConfigField::MouseInit,
+	                       mouse_init, sizeof(mouse_init));
+	// Wrong lengths, and no such field
+	pass &= !configSetField(config, (uint8_t)ConfigField::Protocol,
+	                        mouse_init, 2);
+	pass &= !configSetField(config, (uint8_t)ConfigField::MouseInit,
+	                        mouse_init, 2);
+	pass &= !configSetField(config, 0x42, baud, 1);
+	uint8_t field[1 + CONFIG_MAX_INIT];
+	pass &= (configGetField(config, (uint8_t)ConfigField::MouseInit, field) ==
+	         3);
+	pass &= (memcmp(field, mouse_init, sizeof(mouse_init)) == 0);
+	pass &= (configGetField(config, (uint8_t)ConfigField::KeyboardInit,
+	                        field) == 1) && (field[0] == 0);
+	pass &= (configGetField(config, 0x42, field) < 0);
+
+	uint8_t block[CONFIG_BLOCK_SIZE];
+	configToBlock(config, block);
+	Config loaded = {};
+	pass &= configFromBlock(block, loaded);
+	pass &= (memcmp(&loaded, &config, sizeof(config)) == 0);
+	// One flipped bit, or an old version, and it's ignored
+	block[3] ^= 0x10;
+	pass &= !configFromBlock(block, loaded);
+	block[3] ^= 0x10;
+	block[0] = CONFIG_VERSION + 1;
+	pass &= !configFromBlock(block, loaded);
+	// An erased EEPROM reads as all FF
+	memset(block, 0xFF, sizeof(block));
+	pass &= !configFromBlock(block, loaded);
+	return pass;
+}
+
+// Check the mouse assembler only finds packets once reporting is enabled
+DEFINE_TEST(mouse_finds_packets)
+{
+	MouseAssembler mouse;
+	bool pass = true;
+	// Not streaming yet, so this goes straight through
+	pass &= mouse.feed(0xFA);
+	mouse.onHostByte(0xF4);
+	pass &= mouse.feed(0xFA);
+	// Now a packet - left button, dx = -1, dy = 2
+	pass &= !mouse.feed(0x19);
+	pass &= !mouse.feed(0xFF);
+	pass &= !mouse.feed(0x02);
+	uint8_t out[4];
+	uint8_t len = mouse.takePacket(out);
+	pass &= (len == 3) && (out[0] == 0x19) && (out[1] == 0xFF) &&
+	        (out[2] == 0x02);
+	pass &= !mouse.hasPacket();
+	return pass;
+}
+
+// Check a whole init sequence sent in one go is followed, ACK by ACK
+DEFINE_TEST(mouse_sequence)
+{
+	MouseAssembler mouse;
+	// IntelliMouse knock, then Get Device ID, then Enable Data Reporting
+	static const uint8_t init[] = {0xF3, 0xC8, 0xF3, 0x64, 0xF3,
+	                               0x50, 0xF2, 0xF4};
+	mouse.onHostBytes(init, sizeof(init));
+	bool pass = true;
+	for (int i = 0; i < 7; i++)
+	{
+		// An ACK looks like a status byte, but none of these are packets
+		pass &= mouse.feed(0xFA);
+	}
+	pass &= mouse.feed(0x03);
+	pass &= mouse.feed(0xFA);
+	// Now streaming four byte packets - wheel down one
+	pass &= !mouse.feed(0x08);
+	pass &= !mouse.feed(0x00);
+	pass &= !mouse.feed(0x00);
+	pass &= !mouse.hasPacket();
+	pass &= !mouse.feed(0x01);
+	uint8_t out[4];
+	pass &= (mouse.takePacket(out) == 4) && (out[3] == 0x01);
+	return pass;
+}
+
+// Check movement is added up while nobody takes the packets
+DEFINE_TEST(mouse_accumulates)
+{
+	MouseAssembler mouse;
+	mouse.onHostByte(0xF4);
+	mouse.feed(0xFA);
+	// 200 right, four times, with no buttons
+	for (int i = 0; i < 4; i++)
+	{
+		mouse.feed(0x08);
+		mouse.feed(200);
+		mouse.feed(0x00);
+	}
+	// Then a click, which must not be merged in
+	mouse.feed(0x09);
+	mouse.feed(0x00);
+	mouse.feed(0x00);
+	uint8_t out[4];
+	int total = 0;
+	int packets = 0;
+	while (mouse.takePacket(out) != 0)
+	{
+		if (out[0] & 0x01)
+		{
+			break;
+		}
+		total += out[1];
+		packets++;
+	}
+	// 800 doesn't fit in one packet, so it's split over several, and the
+	// click comes after them
+	return (total == 800) && (packets == 4) && (out[0] & 0x01) &&
+	       !mouse.hasPacket();
+}
+
+// Check held keys are only reported once, and E0 keys get the top bit
+DEFINE_TEST(keyboard_decode)
+{
+	KeyboardDecoder kb;
+	uint8_t key = 0;
+	bool pass = true;
+	// 'A' pressed, repeated, released
+	pass &= (kb.feed(0x1C, key) == KeyboardDecodeResult::Pressed) &&
+	        (key == 0x1C);
+	pass &= (kb.feed(0x1C, key) == KeyboardDecodeResult::Nothing);
+	pass &= kb.isPressed(0x1C);
+	pass &= (kb.feed(0xF0, key) == KeyboardDecodeResult::Nothing);
+	pass &= (kb.feed(0x1C, key) == KeyboardDecodeResult::Released) &&
+	        (key == 0x1C);
+	pass &= !kb.isPressed(0x1C);
+	// Right Ctrl pressed and released
+	pass &= (kb.feed(0xE0, key) == KeyboardDecodeResult::Nothing);
+	pass &= (kb.feed(0x14, key) == KeyboardDecodeResult::Pressed) &&
+	        (key == 0x94);
+	pass &= !kb.isPressed(0x14);
+	kb.feed(0xE0, key);
+	kb.feed(0xF0, key);
+	pass &= (kb.feed(0x14, key) == KeyboardDecodeResult::Released) &&
+	        (key == 0x94);
+	// ACK isn't a key
+	pass &= (kb.feed(0xFA, key) == KeyboardDecodeResult::Raw);
+	// Pause
+	const uint8_t pause[] = {0xE1, 0x14, 0x77, 0xE1, 0xF0, 0x14, 0xF0, 0x77};
+	for (int i = 0; i < 7; i++)
+	{
+		pass &= (kb.feed(pause[i], key) == KeyboardDecodeResult::Nothing);
+	}
+	pass &= (kb.feed(pause[7], key) ==
+	         KeyboardDecodeResult::PressedAndReleased) &&
+	        (key == 0xF7);
+	return pass;
+}
+
+// Check a BAT or overrun releases the held keys, so none get stuck
+DEFINE_TEST(keyboard_reset)
+{
+	KeyboardDecoder kb;
+	uint8_t key = 0;
+	bool pass = true;
+	const uint8_t resets[] = {0xAA, 0x00, 0xFF};
+	for (size_t i = 0; i < sizeof(resets); i++)
+	{
+		// Hold 'A' and Right Ctrl
+		kb.feed(0x1C, key);
+		kb.feed(0xE0, key);
+		kb.feed(0x14, key);
+		pass &= (kb.feed(resets[i], key) == KeyboardDecodeResult::Reset);
+		uint8_t released[3] = {0, 0, 0};
+		int count = 0;
+		while ((count < 3) && kb.takeHeldKey(key))
+		{
+			released[count++] = key;
+		}
+		pass &= (count == 2) && (released[0] == 0x1C) &&
+		        (released[1] == 0x94);
+		// The next press of 'A' is a press again, not a repeat
+		pass &= (kb.feed(0x1C, key) == KeyboardDecodeResult::Pressed);
+		kb.feed(0xF0, key);
+		kb.feed(0x1C, key);
+	}
+	// Other non-key bytes leave the held keys alone
+	kb.feed(0x1C, key);
+	pass &= (kb.feed(0xFA, key) == KeyboardDecodeResult::Raw);
+	pass &= kb.isPressed(0x1C);
+	return pass;
+}
+
+// Check the exact bytes of each indication, in ASCII and binary
+DEFINE_TEST(report_framing)
+{
+	const uint8_t key[] = {0xFA};
+	const uint8_t move[] = {0x08, 0x01, 0xFE};
+	const uint8_t done[] = {0x01, 0x00};
+	char out[REPORT_MAX_MESSAGE];
+	uint8_t len;
+	bool pass = true;
+	len = formatReport(HostProtocol::Ascii, Report::Keyboard, key,
+	                   sizeof(key), out);
+	pass &= (len == 4) && (memcmp(out, "kFA\n", 4) == 0);
+	len = formatReport(HostProtocol::Ascii, Report::Mouse, move,
+	                   sizeof(move), out);
+	pass &= (len == 8) && (memcmp(out, "m0801FE\n", 8) == 0);
+	len = formatReport(HostProtocol::Ascii, Report::WriteDone, done,
+	                   sizeof(done), out);
+	pass &= (len == 6) && (memcmp(out, "a0100\n", 6) == 0);
+	// 1cccllll - channel, then length minus one
+	len = formatReport(HostProtocol::Binary, Report::Keyboard, key,
+	                   sizeof(key), out);
+	pass &= (len == 2) && (memcmp(out, "\x80\xFA", 2) == 0);
+	len = formatReport(HostProtocol::Binary, Report::Mouse, move,
+	                   sizeof(move), out);
+	pass &= (len == 4) && (memcmp(out, "\x92\x08\x01\xFE", 4) == 0);
+	len = formatReport(HostProtocol::Binary, Report::WriteDone, done,
+	                   sizeof(done), out);
+	pass &= (len == 3) && (memcmp(out, "\xE1\x01\x00", 3) == 0);
+	// And back to ASCII - nothing is left over from binary
+	len = formatReport(HostProtocol::Ascii, Report::Keyboard, key,
+	                   sizeof(key), out);
+	pass &= (len == 4) && (memcmp(out, "kFA\n", 4) == 0);
+	// A full 16-byte payload uses all of llll
+	uint8_t full[BINARY_MAX_PAYLOAD];
+	memset(full, 0x55, sizeof(full));
+	len = formatReport(HostProtocol::Binary, Report::KeyPressed, full,
+	                   sizeof(full), out);
+	pass &= (len == 17) && ((uint8_t)out[0] == 0xCF) &&
+	        (memcmp(&out[1], full, sizeof(full)) == 0);
+	len = formatReport(HostProtocol::Ascii, Report::KeyPressed, full,
+	                   sizeof(full), out);
+	pass &= (len == REPORT_MAX_MESSAGE) && (out[0] == 'p') &&
+	        (out[len - 1] == '\n');
+	return pass;
+}
+
+// What a ReportBatcher has sent, as one string of "<source>:<bytes> "
+static char batch_sent[128];
+static void batch_send(Report source, const uint8_t *data, uint8_t data_len)
+{
+	char *p = batch_sent + strlen(batch_sent);
+	p += sprintf(p, "%d:", (int)source);
+	for (uint8_t i = 0; i < data_len; i++)
+	{
+		p += sprintf(p, "%02X", data[i]);
+	}
+	strcpy(p, " ");
+}
+
+// Check the batch window is fixed from its first byte, and shared
+DEFINE_TEST(batch_window)
+{
+	ReportBatcher batcher(batch_send);
+	batch_sent[0] = '\0';
+	batcher.setWindow(10);
+	batcher.add(Report::Keyboard, 0xFA, 100);
+	batcher.add(Report::Mouse, 0x08, 105);
+	batcher.add(Report::Keyboard, 0xAA, 109);
+	// Later bytes don't hold the window open
+	batcher.flushIfDue(109);
+	bool pass = (batch_sent[0] == '\0') && batcher.isOpen() &&
+	            (batcher.length(Report::Mouse) == 1);
+	batcher.flushIfDue(110);
+	pass &= (strcmp(batch_sent, "0:FAAA 1:08 ") == 0) && !batcher.isOpen();
+	// The next byte opens a new window
+	batch_sent[0] = '\0';
+	batcher.add(Report::Mouse, 0x09, 200);
+	batcher.flushIfDue(209);
+	pass &= (batch_sent[0] == '\0');
+	batcher.flushIfDue(210);
+	pass &= (strcmp(batch_sent, "1:09 ") == 0);
+	// Turned off, each byte goes straight out
+	batch_sent[0] = '\0';
+	batcher.setWindow(ReportBatcher::DISABLED);
+	batcher.add(Report::Keyboard, 0x1C, 300);
+	pass &= (strcmp(batch_sent, "0:1C ") == 0) && !batcher.isOpen();
+	return pass;
+}
+
+// Check a full batch goes early, and `flushAll` doesn't wait
+DEFINE_TEST(batch_flush)
+{
+	ReportBatcher batcher(batch_send);
+	batch_sent[0] = '\0';
+	batcher.setWindow(50);
+	batcher.add(Report::Mouse, 0x08, 0);
+	for (uint8_t i = 0; i < BINARY_MAX_PAYLOAD; i++)
+	{
+		batcher.add(Report::Keyboard, i, 1);
+	}
+	bool pass =
+	    (strcmp(batch_sent, "0:000102030405060708090A0B0C0D0E0F ") == 0) &&
+	    (batcher.length(Report::Keyboard) == 0) &&
+	    (batcher.length(Report::Mouse) == 1);
+	// Like before a decoded key - everything waiting goes, keyboard first
+	batch_sent[0] = '\0';
+	batcher.add(Report::Keyboard, 0xFA, 2);
+	batcher.flushAll();
+	pass &= (strcmp(batch_sent, "0:FA 1:08 ") == 0) && !batcher.isOpen();
+	// Changing the window sends what was gathered under the old one
+	batch_sent[0] = '\0';
+	batcher.add(Report::Keyboard, 0xEE, 3);
+	batcher.setWindow(0);
+	pass &= (strcmp(batch_sent, "0:EE ") == 0);
+	// A zero window lasts until the next check
+	batch_sent[0] = '\0';
+	batcher.add(Report::Keyboard, 0x01, 4);
+	pass &= (batch_sent[0] == '\0');
+	batcher.flushIfDue(4);
+	pass &= (strcmp(batch_sent, "0:01 ") == 0);
+	return pass;
+}
+
+// Check each joystick pin lands in the right bit
+DEFINE_TEST(joystick_scan)
+{
+	// Up, down, left, right, A/B, start/C, select
+	Joystick<0, 1, 2, 3, 4, 5, 6> js;
+	for (int i = 0; i < 6; i++)
+	{
+		pin_results[i] = 1;
+	}
+	pin_results[0] = 0;
+	pin_results[4] = 0;
+	pin_results[5] = 0;
+	bool pass = js.scan();
+	JoystickResult result = js.read();
+	pass &= result.is_up_pressed() && result.is_a_pressed() &&
+	        result.is_start_pressed();
+	pass &= (result.value() == 0x0091);
+	// No change, so nothing new
+	pass &= !js.scan();
+	return pass;
+}
+
+// A SEGA MegaDrive six button pad on pins 0..5, with SELECT on pin 6,
+// holding down Up, A, C, Y and Mode.
+static int sega_select;
+static int sega_rises;
+static unsigned long sega_last_change;
+
+static void sega_write(int pin, bool level)
+{
+	if (pin != 6)
+	{
+		return;
+	}
+	if (micros() - sega_last_change > 1500)
+	{
+		// Left alone long enough to reset the count
+		sega_rises = 0;
+	}
+	if (level && !sega_select)
+	{
+		sega_rises++;
+	}
+	sega_select = level;
+	sega_last_change = micros();
+}
+
+static int sega_read(int pin)
+{
+	// Up, down, left, right, A/B, start/C - active low
+	static const int low[] = {0, 1, 0, 0, 0, 1};
+	static const int third_low[] = {0, 0, 0, 0, 0, 1};
+	static const int high[] = {0, 1, 1, 1, 1, 0};
+	// Z, Y, X, Mode, B, C
+	static const int third_high[] = {1, 0, 1, 0, 1, 0};
+	if (sega_select)
+	{
+		return (sega_rises == 3) ? third_high[pin] : high[pin];
+	}
+	return (sega_rises == 2) ? third_low[pin] : low[pin];
+}
+
+// Check the six button pad is read across several scans, without delays
+DEFINE_TEST(joystick_six_button)
+{
+	sega_select = 0;
+	sega_rises = 0;
+	sega_last_change = micros();
+	pin_read_hook = sega_read;
+	pin_write_hook = sega_write;
+	Joystick<0, 1, 2, 3, 4, 5, 6> js;
+	int scans = 0;
+	unsigned long start = micros();
+	while (!js.scan() && (micros() - start < 100000))
+	{
+		scans++;
+	}
+	pin_read_hook = NULL;
+	pin_write_hook = NULL;
+	JoystickResult result = js.read();
+	bool pass = (scans > 1);
+	pass &= result.is_up_pressed() && result.is_a_pressed() &&
+	        result.is_c_pressed() && result.is_y_pressed() &&
+	        result.is_mode_pressed();
+	pass &= (result.value() == 0x0A51);
+	return pass;
+}
+
+// Check a bouncing button is only reported once it has settled
+DEFINE_TEST(joystick_debounce)
+{
+	Joystick<0, 1, 2, 3, 4, 5, 6> js;
+	for (int i = 0; i < 6; i++)
+	{
+		pin_results[i] = 1;
+	}
+	js.setDebounce(3);
+	bool pass = !js.scan();
+	// A goes down, bounces up once, then stays down
+	pin_results[4] = 0;
+	pass &= !js.scan();
+	pin_results[4] = 1;
+	pass &= !js.scan();
+	pin_results[4] = 0;
+	pass &= !js.scan();
+	pass &= !js.scan();
+	pass &= js.scan();
+	pass &= (js.read().value() == 0x0010);
+	// A single-sample glitch on another pin never gets through
+	pin_results[0] = 0;
+	pass &= !js.scan();
+	pin_results[0] = 1;
+	pass &= !js.scan();
+	pass &= !js.scan();
+	// Released again after three samples
+	pin_results[4] = 1;
+	pass &= !js.scan();
+	pass &= !js.scan();
+	pass &= js.scan();
+	pass &= (js.read().value() == 0x0000);
+	return pass;
+}
+
+// Check the hex tables agree with the obvious way of doing it
+DEFINE_TEST(hex_codec)
+{
+	bool pass = true;
+	for (int i = 0; i < 256; i++)
+	{
+		char out[2];
+		char expected[3];
+		hexEncode(i, out);
+		snprintf(expected, sizeof(expected), "%02X", i);
+		pass &= (out[0] == expected[0]) && (out[1] == expected[1]);
+		uint8_t nibble = HEX_INVALID;
+		if ((i >= '0') && (i <= '9'))
+		{
+			nibble = i - '0';
+		}
+		else if ((i >= 'A') && (i <= 'F'))
+		{
+			nibble = i - 'A' + 10;
+		}
+		else if ((i >= 'a') && (i <= 'f'))
+		{
+			nibble = i - 'a' + 10;
+		}
+		pass &= (hexDecode(i) == nibble);
+	}
+	return pass;
+}
+
+// Check whole commands are queued, and bad or unwanted lines aren't
+DEFINE_TEST(command_parser)
+{
+	SpscRingBuf<HostCommand, 4> queue;
+	CommandParser<SpscRingBuf<HostCommand, 4>> parser(queue, HOST_COMMANDS);
+	// The bad lines end in C, D and E commands, which mustn't run. A newline
+	// that spoils a line still ends it, so the D01 after K0 does run.
+	const char input[] = "KED02\r\nUUUX01\nP0\nP01\n"
+	                     "M000102030405060708090A0B0C0D0E0F1E05\n"
+	                     "KZZD01\n"
+	                     "M0G0C01\n"
+	                     "K0\nD01\n";
+	for (size_t i = 0; i < sizeof(input) - 1; i++)
+	{
+		parser.push(input[i]);
+	}
+	HostCommand command;
+	bool pass = queue.pop(command);
+	pass &= (command.command == 'K') && (command.length == 2) &&
+	        (command.data[0] == 0xED) && (command.data[1] == 0x02);
+	pass &= queue.pop(command);
+	pass &= (command.command == 'P') && (command.length == 1) &&
+	        (command.data[0] == 0x01);
+	pass &= queue.pop(command);
+	pass &= (command.command == 'D') && (command.length == 1) &&
+	        (command.data[0] == 0x01);
+	pass &= !queue.pop(command) && (parser.dropped() == 0);
+	// Three slots - the fourth command is dropped, up to its newline
+	for (int i = 0; i < 4; i++)
+	{
+		const char line[] = "K00\n";
+		for (size_t n = 0; n < sizeof(line) - 1; n++)
+		{
+			parser.push(line[n]);
+		}
+	}
+	pass &= (queue.size() == 3) && (parser.dropped() == 1);
+	return pass;
+}
+
+static bool sched_hot;
+static bool sched_heat_up;
+static int sched_runs[3];
+static void sched_urgent()
+{
+	sched_runs[0]++;
+	sched_hot |= sched_heat_up;
+}
+static void sched_plain() { sched_runs[1]++; }
+static void sched_periodic() { sched_runs[2]++; }
+static bool sched_is_hot() { return sched_hot; }
+
+// Check only urgent tasks run while hot, and periods are kept to
+DEFINE_TEST(scheduler_hot)
+{
+	static const Task tasks[] = {
+		{ sched_urgent, 0, true },
+		{ sched_plain, 0, false },
+		{ sched_periodic, 50000, false },
+	};
+	Scheduler<3> sched(tasks, sched_is_hot);
+	sched_hot = false;
+	sched_heat_up = false;
+	memset(sched_runs, 0, sizeof(sched_runs));
+	for (int i = 0; i < 100; i++)
+	{
+		sched.runPass();
+	}
+	bool pass = (sched_runs[0] == 100) && (sched_runs[1] == 100);
+	pass &= (sched_runs[2] <= 2);
+	// Going hot part way through a pass stops the rest of it
+	memset(sched_runs, 0, sizeof(sched_runs));
+	sched_heat_up = true;
+	sched.runPass();
+	sched.runPass();
+	pass &= (sched_runs[0] == 2) && (sched_runs[1] == 0);
+	return pass;
+}
+
 int bitRead(int word, int bit)
 {
 	return ((word & (1 << bit)) != 0) ? 1 : 0;
@@ -110,6 +1054,10 @@ int bitRead(int word, int bit)
 
 void digitalWrite(int pin, bool level)
 {
+	if (pin_write_hook)
+	{
+		pin_write_hook(pin, level);
+	}
 #ifdef VERBOSE_DEBUG
 	printf("Writing pin %d = %d\r\n", pin, level);
 #endif
@@ -127,6 +1075,10 @@ int digitalRead(int pin)
 #ifdef VERBOSE_DEBUG
 	printf("Reading pin %d = %d\r\n", pin, pin_results[pin]);
 #endif
+	if (pin_read_hook)
+	{
+		return pin_read_hook(pin);
+	}
 	return pin_results[pin];
 }
 
@@ -141,8 +1093,36 @@ unsigned long micros() {
 const test_fn_t TESTS[] = {
 	ps2_timeout,
 	ps2_collect_bits,
+	ps2_isr_collect_bits,
+	ps2_write_resend,
+	ps2_watermarks,
+	ps2_counters,
+	ps2_quiet,
+	ps2_bus,
 	ps2_validate_words,
 	ps2_encode_bytes,
+	ps2_bad_words,
+	ringbuf_read_span,
+	ringbuf_spsc,
+	ringbuf_bulk,
+	output_priority,
+	output_mouse_reserve,
+	capture_runs,
+	config_block,
+	mouse_finds_packets,
+	mouse_sequence,
+	mouse_accumulates,
+	keyboard_decode,
+	keyboard_reset,
+	report_framing,
+	batch_window,
+	batch_flush,
+	joystick_scan,
+	joystick_six_button,
+	joystick_debounce,
+	hex_codec,
+	command_parser,
+	scheduler_hot,
 };
 
 int main(int argc, char **argv)
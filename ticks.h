@@ -0,0 +1,64 @@
+/**
+ * Neotron-IO monotonic tick counter.
+ *
+ * Timer1 free-runs at F_CPU / 8 (set up in `setup()`), so reading TCNT1 gives
+ * a 16-bit tick count for a handful of cycles, rather than calling `micros()`
+ * with its Timer0 overflow arithmetic. At 8 MHz a tick is 1us and the count
+ * wraps every 65ms, so only time things shorter than that, by subtracting
+ * the start tick from `ticksNow()`.
+ *
+ * On the host, where there is no Timer1, ticks are microseconds.
+ *
+ * This project is also licensed under the GPL (v3 or later version, at your
+ * choice). See the [LICENCE](./LICENCE) file.
+ */
+
+#ifndef TICKS_H
+#define TICKS_H
+
+#include "DigitalPin.h"
+
+#ifdef SLOW_IO_FUNCTIONS
+
+static constexpr uint32_t TICKS_PER_SECOND = 1000000;
+
+static inline uint16_t ticksNow()
+{
+	return micros();
+}
+
+#else
+
+static constexpr uint32_t TICKS_PER_SECOND = F_CPU / 8;
+
+/**
+ * Read the tick counter. Safe to call from an interrupt.
+ */
+static inline uint16_t ticksNow()
+{
+	// A 16-bit read goes through the shared TEMP register, so don't let an
+	// interrupt that also reads Timer1 in between the two halves.
+	uint8_t sreg = SREG;
+	cli();
+	uint16_t now = TCNT1;
+	SREG = sreg;
+	return now;
+}
+
+#endif
+
+/**
+ * Convert a time in microseconds to ticks, done by the compiler. It won't
+ * compile if the answer doesn't fit in 16 bits (about 65ms at 8 MHz, but
+ * only 32ms at 16 MHz) - time anything longer with `millis()`.
+ */
+template <uint32_t MICROS>
+static constexpr uint16_t ticksFromMicros()
+{
+	static_assert( ( (uint64_t)MICROS * ( TICKS_PER_SECOND / 1000 ) ) / 1000 <=
+	                   UINT16_MAX,
+	               "Too long to count in 16-bit ticks" );
+	return ( (uint64_t)MICROS * ( TICKS_PER_SECOND / 1000 ) ) / 1000;
+}
+
+#endif  // TICKS_H
@@ -0,0 +1,168 @@
+/**
+ * Neotron-IO host UART driver.
+ *
+ * Drives USART0 directly, instead of going through the Arduino `Serial`
+ * object. The transmitter is interrupt driven: the Data Register Empty
+ * interrupt takes bytes straight out of the caller's transmit buffer, so
+ * nothing is copied into a second buffer and `loop()` never has to feed the
+ * UART one byte at a time. Received bytes are handed to the caller's receive
+ * sink by the RX Complete interrupt - anything with a `push( char )`, such
+ * as a `SpscRingBuf` or a `CommandParser`.
+ *
+ * The transmit buffer has one side in an interrupt and the other in
+ * `loop()`, so use `SpscRingBuf` and nothing here has to turn interrupts off.
+ *
+ * Don't use `Serial` anywhere else in the sketch, otherwise the Arduino core
+ * will try to install its own USART interrupt handlers.
+ *
+ * This project is also licensed under the GPL (v3 or later version, at your
+ * choice). See the [LICENCE](./LICENCE) file.
+ */
+
+#include "RingBuf.h"
+
+/**
+ * Represents the UART link to the host.
+ */
+template <typename TX_BUFFER, typename RX_SINK>
+class HostUart
+{
+   public:
+	/**
+	 * Construct a new HostUart object.
+	 *
+	 * @param tx_buffer the buffer we transmit from
+	 * @param rx_sink what we give received bytes to, in the interrupt
+	 */
+	HostUart( TX_BUFFER& tx_buffer, RX_SINK& rx_sink )
+	    : m_tx_buffer( tx_buffer ),
+	      m_rx_sink( rx_sink ),
+	      m_has_sent( false ),
+	      m_dropped( 0 )
+	{
+	}
+
+	/**
+	 * Start the USART at the given baud rate, 8N1, in double-speed mode.
+	 */
+	void begin( uint32_t baud )
+	{
+		// Round to the nearest divisor
+		uint16_t ubrr = ( ( F_CPU + ( 4 * baud ) ) / ( 8 * baud ) ) - 1;
+		UCSR0B = 0;
+		UBRR0H = ubrr >> 8;
+		UBRR0L = ubrr & 0xFF;
+		UCSR0A = _BV( U2X0 );
+		m_has_sent = false;
+		UCSR0C = _BV( UCSZ01 ) | _BV( UCSZ00 );
+		UCSR0B = _BV( RXEN0 ) | _BV( TXEN0 ) | _BV( RXCIE0 );
+	}
+
+	/**
+	 * Put a byte in the transmit buffer.
+	 *
+	 * The buffers are single-producer / single-consumer, so no interrupts
+	 * are masked here - we just make sure the UDRE interrupt is on once the
+	 * byte is in.
+	 *
+	 * @return true if there was space, false if the byte was dropped.
+	 */
+	bool write( char c )
+	{
+		bool result = m_tx_buffer.push( c );
+		if ( !result )
+		{
+			m_dropped++;
+		}
+		UCSR0B |= _BV( UDRIE0 );
+		return result;
+	}
+
+	/**
+	 * Put a run of bytes in the transmit buffer, in one go.
+	 *
+	 * @return how many bytes there was space for. The rest were dropped.
+	 */
+	size_t write( const char* data, size_t data_len )
+	{
+		size_t result = m_tx_buffer.pushN( data, data_len );
+		m_dropped += data_len - result;
+		UCSR0B |= _BV( UDRIE0 );
+		return result;
+	}
+
+	/**
+	 * How many more bytes will fit in the transmit buffer?
+	 *
+	 * The UDRE interrupt may free up more while you look.
+	 */
+	size_t spaceAvailable()
+	{
+		return m_tx_buffer.maxSize() - m_tx_buffer.size();
+	}
+
+	/**
+	 * How many bytes have been dropped because the transmit buffer was full,
+	 * since `clearDropped` (wraps round at 0xFFFF).
+	 */
+	uint16_t dropped() const { return m_dropped; }
+
+	void clearDropped() { m_dropped = 0; }
+
+	/**
+	 * Have we finished sending everything in the transmit buffer?
+	 *
+	 * Use this to wait for the last byte to go before calling `begin` with a
+	 * new baud rate.
+	 */
+	bool isIdle()
+	{
+		// TXC0 only gets set once something has actually been sent
+		return m_tx_buffer.isEmpty() &&
+		       ( !m_has_sent || ( UCSR0A & _BV( TXC0 ) ) );
+	}
+
+	/**
+	 * Call this from the USART Data Register Empty interrupt.
+	 */
+	void onDataRegisterEmpty()
+	{
+		typename TX_BUFFER::Span span = m_tx_buffer.contiguousReadable();
+		if ( span.length == 0 )
+		{
+			// Nothing left to send - stop interrupting until `write` is
+			// called again.
+			UCSR0B &= ~_BV( UDRIE0 );
+			return;
+		}
+		UDR0 = span.data[0];
+		m_tx_buffer.consume( 1 );
+		m_has_sent = true;
+		// Clear the transmit complete flag, for `isIdle`
+		UCSR0A = ( UCSR0A & ( _BV( U2X0 ) | _BV( MPCM0 ) ) ) | _BV( TXC0 );
+	}
+
+	/**
+	 * Call this from the USART RX Complete interrupt.
+	 */
+	void onReceive()
+	{
+		bool had_error = ( UCSR0A & ( _BV( FE0 ) | _BV( DOR0 ) ) ) != 0;
+		// Always read UDR0 to clear the interrupt
+		char c = UDR0;
+		if ( !had_error )
+		{
+			m_rx_sink.push( c );
+		}
+	}
+
+#ifndef TEST_MODE_NO_PRIVATE
+   private:
+#endif
+
+	TX_BUFFER& m_tx_buffer;
+	RX_SINK& m_rx_sink;
+	volatile bool m_has_sent;
+	/// Only touched by `write`, so no need for volatile
+	uint16_t m_dropped;
+};